@@ -2,16 +2,30 @@
 //CDA3101
 //December 3rd, 2015
 //Modular Data Cache Simulator
+//Compile: gcc -O2 -pthread -DHAVE_ZLIB drew_smith_a5.c ../trace/trace.c -lm -lz
 //////////////////////////////
 
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "../trace/trace.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 typedef struct{ 
   char access;
   int size;
-  int address;
+  uint64_t address;
 } MemRef;
 
 typedef struct{
@@ -19,93 +33,430 @@ typedef struct{
   int offset;
   int result;
   int memref;
+  int way;
 } Trans;
 
 typedef struct{
   int valid;
-  int tag;
+  uint64_t tag;
   int dirty;
-  int age;
 } Block;
 
-int numSets, setSize, lineSize;                   
-Block **cache;                                  
+// Replacement policies, chosen with -p
+enum { LRU, PLRU, FIFO, RANDOM, LFU, SRRIP, BRRIP, DIP, OPT, NUM_POLICIES };
+
+static const char *policyNames[NUM_POLICIES] =
+  { "lru", "plru", "fifo", "random", "lfu", "srrip", "brrip", "dip", "opt" };
+
+#define RRPV_MAX        3    // 2-bit re-reference prediction values
+#define BIMODAL         32   // BRRIP/BIP insert near MRU once every 32 fills
+#define PSEL_MAX        1023 // 10-bit DIP policy selector
+#define DUEL_LEADERS    32   // DIP: up to 32 LRU and 32 BIP leader sets
+#define DUEL_MIN_PERIOD 4    // DIP: leaders take at most half the sets
+
+// Simulation modes, chosen with -m
+enum { MODE_SIMULATE, MODE_STACK, MODE_ALLASSOC, MODE_SWEEP, MODE_PARTITION, MODE_PIPELINE, MODE_CLASSIFY, MODE_HIERARCHY, NUM_MODES };
+
+static const char *modeNames[NUM_MODES] = { "simulate", "stack", "allassoc", "sweep", "partition", "pipeline", "classify", "hierarchy" };
+
+#define RING_SIZE 4096   // references per lock-free queue, a power of 2
+#define RING_BATCH 256   // references the pipeline parser publishes at once
+
+// Write policies, chosen with -w
+enum { WRITE_BACK, WRITE_THROUGH, NUM_WRITE_POLICIES };
+
+static const char *writeNames[NUM_WRITE_POLICIES] = { "wb", "wt" };
+
+#define MAX_ALL_WAYS 16  // deepest associativity -m allassoc reports
+
+// Tag lookup kernels, chosen with -k
+enum { KERNEL_AUTO, KERNEL_SCALAR, KERNEL_SSE2, KERNEL_AVX2, NUM_KERNELS };
+
+static const char *kernelNames[NUM_KERNELS] = { "auto", "scalar", "sse2", "avx2" };
+
+// How a lower cache level relates to the levels above it, chosen per
+// level in the -L hierarchy file
+enum { INCLUSIVE, EXCLUSIVE, NINE, NUM_INCLUSIONS };
+
+static const char *inclusionNames[NUM_INCLUSIONS] = { "inclusive", "exclusive", "nine" };
+
+// Per-reference report levels, chosen with -v
+enum { VERBOSE_SUMMARY, VERBOSE_SAMPLE, VERBOSE_FULL, NUM_VERBOSITY };
+
+static const char *verbosityNames[NUM_VERBOSITY] = { "summary", "sample", "full" };
+
+#define REPORT_BUFFER (1 << 20) // bytes of formatted rows per output buffer
+#define REPORT_ROW    128       // longest row PrintData can format
+#define SAMPLE_EVERY  1000      // default -e for -v sample
+
+#define CONVERGED_SNAPSHOTS 3   // snapshots in a row within -x to stop early
+
+typedef struct{
+  int numSets, setSize, lineSize;
+  int policy;
+  int writePolicy;
+
+  // Line state, one contiguous run per set. Each set's tags are padded to
+  // tagStride ways (a multiple of 8) so the vector kernels never need a
+  // scalar tail; padding ways are never valid. Tags stay 32 bits until
+  // one needs more, then WidenTags moves them all to wideTags.
+  int tagStride, maskWords;
+  int32_t *tags;       // numSets * tagStride, NULL once widened
+  uint64_t *wideTags;  // numSets * tagStride, NULL until widened
+  uint64_t *valid;     // numSets * maskWords, bit per way
+  uint64_t *dirty;     // numSets * maskWords, bit per way
+
+  // Per-set replacement state
+  int *filled;         // ways filled so far (sets fill in way order)
+  int *head, *tail;    // LRU/DIP: MRU and LRU ends of the recency list
+  int *prev, *next;    // LRU/DIP: recency list links, one per line
+  uint64_t *plru;      // PLRU: setSize - 1 tree bits
+  int *fifo;           // FIFO: next way to replace
+  uint32_t *seed;      // RANDOM/BRRIP/DIP: per-set xorshift state
+  uint32_t *count;     // LFU: references per line
+  uint8_t *rrpv;       // SRRIP/BRRIP: re-reference prediction per line
+  int psel;            // DIP: saturating LRU vs BIP selector
+  int duelPeriod;      // DIP: one LRU and one BIP leader per this many sets
+  uint64_t *nextUse;   // OPT: when each line is next referenced
+  int *heap, *heapPos; // OPT: per-set max-heap of ways by next use
+  uint64_t upcoming;   // OPT: next use of the line being referenced
+} Cache;
+
+Cache cache;
+
+#define TRACE_BATCH 1024  // references ReadRef takes from the reader at once
+
+// A trace in any dialect, read through the shared reader (see trace.h)
+typedef struct{
+  TraceInput input;
+  TraceRef batch[TRACE_BATCH];
+  long length, next;
+} Trace;
+
+// Return the way in a set holding tag, or -1
+typedef int (*FindWayFn)(const int32_t *, const uint64_t *, int, int32_t);
+typedef int (*FindWay64Fn)(const uint64_t *, const uint64_t *, int, uint64_t);
+FindWayFn FindWay;
+FindWay64Fn FindWay64;
+
+// The per-reference table, formatted into large buffers instead of one
+// printf per row. With -b full buffers are handed to a writer thread so
+// formatting the next one overlaps the write.
+typedef struct{
+  int verbosity;
+  long every;          // VERBOSE_SAMPLE: one row per this many references
+  int background;
+  char *buffer[2];
+  int active;          // buffer being formatted into
+  size_t length;       // bytes used in buffer[active]
+
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  char *pending;       // full buffer waiting for the writer, or NULL
+  size_t pendingLength;
+  int done;
+} Report;
+
+Report report;
+
+// Interval statistics, written every -n references as JSON lines (or CSV
+// when the -o file ends in .csv). Without -o they go to stderr, since the
+// per-reference table is buffered separately on stdout.
+typedef struct{
+  FILE *out;
+  int csv;
+  long period;         // references per snapshot, 0 for none
+  double tolerance;    // -x convergence bound, < 0 to never stop early
+  long next;           // reference count of the next snapshot, -1 for none
+  long last;           // reference count of the previous snapshot
+  long hits, misses, memrefs;  // totals at the previous snapshot
+  int steady;          // snapshots in a row within tolerance
+} Stats;
+
+Stats stats;
 
 void OpenRequest(FILE **);                      
 void ReadRequest(FILE **, int *, int *, int *); 
-void Initialize(); 
-int  CacheRead(Trans *, Block *);               
-void CacheWrite(Trans *, Block *);                                                               
-void Calculate(MemRef *, Trans *, Block *);     
-void PrintData(int, MemRef *, Trans *, Block *);
-void Layout();              
+int  ParsePolicy(const char *);
+int  ParseWritePolicy(const char *);
+void SelectKernel(int);
+void WidenTags(Cache *);
+Trace *OpenTrace(FILE *);
+int  ReadRef(Trace *, MemRef *, int);
+long LoadTrace(Trace *, MemRef **);
+void StackDistance(MemRef *, long, int);
+void AllAssociativity(Trace *, int, int);
+void Classify(Trace *, Cache *);
+void Sweep(Trace *, const char *, int);
+void Hierarchy(Trace *, const char *);
+void Partition(Trace *, Cache *, int);
+void Pipeline(Trace *, Cache *, Report *, Stats *);
+void Optimal(Trace *, Cache *, Report *, Stats *);
+void Initialize(Cache *);
+void Release(Cache *);
+int  CacheRead(Cache *, Trans *, Block *);
+void CacheWrite(Cache *, Trans *, Block *);
+void Calculate(Cache *, MemRef *, Trans *, Block *);
+int  Access(Cache *, MemRef *, Trans *, Block *);
+void PolicyTouch(Cache *, int, int);
+int  PolicyVictim(Cache *, int);
+void PolicyFill(Cache *, int, int);
+void ReportOpen(Report *);
+void ReportClose(Report *);
+void PrintData(Report *, int, MemRef *, Trans *, Block *);
+void Layout(Cache *, Report *);
 void PrintCache(int, int);                      
+void StatsOpen(Stats *, const char *);
+int  Snapshot(Stats *, long, long, long);
+void StatsClose(Stats *, long, long, long);
 
-int main() 
+int main(int argc, char **argv)
 {
   FILE *file;
+  Trace *trace;
+  int opt, kernel = KERNEL_AUTO, mode = MODE_SIMULATE;
+  int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  const char *sweepFile = NULL, *statsFile = NULL, *levelFile = NULL;
+  char *end;
+
+  cache.policy = FIFO;
+  cache.writePolicy = WRITE_BACK;
+  report.verbosity = VERBOSE_FULL;
+  report.every = SAMPLE_EVERY;
+  stats.tolerance = -1;
+  while ((opt = getopt(argc, argv, "p:k:m:w:s:t:v:e:bn:o:x:L:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'L':
+        levelFile = optarg;
+        mode = MODE_HIERARCHY;
+        break;
+      case 'n':
+        stats.period = atol(optarg);
+        if (stats.period < 1)
+        {
+          fprintf(stderr, "Error: Need at least 1 reference per snapshot\n");
+          exit(1);
+        }
+        break;
+      case 'o':
+        statsFile = optarg;
+        break;
+      case 'x':
+        stats.tolerance = strtod(optarg, &end);
+        if (*end != '\0' || end == optarg || stats.tolerance < 0)
+        {
+          fprintf(stderr, "Error: Bad tolerance %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'v':
+        for (report.verbosity = 0; report.verbosity < NUM_VERBOSITY; ++report.verbosity)
+          if (strcmp(optarg, verbosityNames[report.verbosity]) == 0)
+            break;
+        if (report.verbosity == NUM_VERBOSITY)
+        {
+          fprintf(stderr, "Error: Unknown verbosity %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'e':
+        report.every = atol(optarg);
+        if (report.every < 1)
+        {
+          fprintf(stderr, "Error: Need to sample at least every reference\n");
+          exit(1);
+        }
+        break;
+      case 'b':
+        report.background = 1;
+        break;
+      case 's':
+        sweepFile = optarg;
+        mode = MODE_SWEEP;
+        break;
+      case 't':
+        threads = atoi(optarg);
+        if (threads < 1)
+        {
+          fprintf(stderr, "Error: Need at least 1 thread\n");
+          exit(1);
+        }
+        break;
+      case 'w':
+        cache.writePolicy = ParseWritePolicy(optarg);
+        if (cache.writePolicy < 0)
+        {
+          fprintf(stderr, "Error: Unknown write policy %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'm':
+        for (mode = 0; mode < NUM_MODES; ++mode)
+          if (strcmp(optarg, modeNames[mode]) == 0)
+            break;
+        if (mode == NUM_MODES)
+        {
+          fprintf(stderr, "Error: Unknown mode %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'k':
+        for (kernel = 0; kernel < NUM_KERNELS; ++kernel)
+          if (strcmp(optarg, kernelNames[kernel]) == 0)
+            break;
+        if (kernel == NUM_KERNELS)
+        {
+          fprintf(stderr, "Error: Unknown lookup kernel %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'p':
+        cache.policy = ParsePolicy(optarg);
+        if (cache.policy < 0)
+        {
+          fprintf(stderr, "Error: Unknown replacement policy %s\n", optarg);
+          exit(1);
+        }
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-m simulate|stack|allassoc|partition|pipeline|classify|hierarchy] [-p lru|plru|fifo|random|lfu|srrip|brrip|dip|opt] [-w wb|wt] [-k auto|scalar|sse2|avx2] [-v summary|sample|full] [-e every] [-b] [-n period] [-o stats file] [-x tolerance] [-s sweep file] [-L hierarchy file] [-t threads] < trace\n", argv[0]);
+        exit(1);
+    }
+  }
+
+  if (stats.period && mode != MODE_SIMULATE && mode != MODE_PIPELINE)
+  {
+    fprintf(stderr, "Error: -n only works with -m simulate or -m pipeline\n");
+    exit(1);
+  }
+  if (stats.tolerance >= 0 && !stats.period)
+  {
+    fprintf(stderr, "Error: -x needs snapshots from -n\n");
+    exit(1);
+  }
+
+  if (cache.policy == OPT && mode != MODE_SIMULATE)
+  {
+    fprintf(stderr, "Error: opt replacement needs the whole trace and only works with -m simulate\n");
+    exit(1);
+  }
+
+  SelectKernel(kernel);
+  trace = OpenTrace(stdin);
+  StatsOpen(&stats, statsFile);
+
+  if (mode == MODE_SWEEP)
+  {
+    if (!sweepFile)
+    {
+      fprintf(stderr, "Error: -m sweep needs a configuration list from -s\n");
+      exit(1);
+    }
+    Sweep(trace, sweepFile, threads);
+    return 0;
+  }
+
+  if (mode == MODE_HIERARCHY)
+  {
+    if (!levelFile)
+    {
+      fprintf(stderr, "Error: -m hierarchy needs a hierarchy file from -L\n");
+      exit(1);
+    }
+    Hierarchy(trace, levelFile);
+    return 0;
+  }
+
   OpenRequest(&file);
-  ReadRequest(&file, &numSets, &setSize, &lineSize);
-  Initialize();
-  
+  ReadRequest(&file, &cache.numSets, &cache.setSize, &cache.lineSize);
+
+  if (mode == MODE_STACK)
+  {
+    MemRef *refs;
+    long n = LoadTrace(trace, &refs);
+    StackDistance(refs, n, cache.lineSize);
+    free(refs);
+    fclose(file);
+    return 0;
+  }
+
+  if (mode == MODE_ALLASSOC)
+  {
+    AllAssociativity(trace, cache.numSets, cache.lineSize);
+    fclose(file);
+    return 0;
+  }
+
+  if (mode == MODE_CLASSIFY)
+  {
+    Classify(trace, &cache);
+    fclose(file);
+    return 0;
+  }
+
+  if (mode == MODE_PARTITION)
+  {
+    Partition(trace, &cache, threads);
+    fclose(file);
+    return 0;
+  }
+
+  if (mode == MODE_PIPELINE)
+  {
+    Pipeline(trace, &cache, &report, &stats);
+    fclose(file);
+    return 0;
+  }
+
+  if (cache.policy == OPT)
+  {
+    Optimal(trace, &cache, &report, &stats);
+    fclose(file);
+    return 0;
+  }
+
+  Initialize(&cache);
+
   int i = 1;
   int hits = 0;  
   int misses = 0;
-  char line[10]; 
+  long memrefs = 0;
 
   MemRef ref;
   Trans t;
   Block b;
-  
-  Layout();
-  while(fgets(line, sizeof(line), stdin)) 
+
+  Layout(&cache, &report);
+  ReportOpen(&report);
+  while(ReadRef(trace, &ref, i))
   {
-    sscanf(line, "%c:%d:%x", &ref.access, &ref.size, &ref.address);
-    switch(ref.size) 
-    {
-      case 1: 
-      case 2: 
-      case 4: 
-      case 8:
-        if (ref.address % ref.size != 0) 
-        {
-          fprintf(stderr, "Error: Invalid size on line %d\n", i);
-            break;
-        }
-      
-        Calculate(&ref, &t, &b);
-        
-        t.result = CacheRead(&t, &b);
-        if (t.result == 0) 
-        {
-          CacheWrite(&t, &b);
-          misses++;
-        } 
-        else 
-          hits++;
-        
-        PrintData(i, &ref, &t, &b);
-        i++;
-        break;
+    if (Access(&cache, &ref, &t, &b))
+      hits++;
+    else
+      misses++;
 
-      default:
-        fprintf(stderr, "Error: Invalid size on line %d\n", i);
-    }   
+    PrintData(&report, i, &ref, &t, &b);
+    memrefs += t.memref;
+    if (i == stats.next && Snapshot(&stats, hits, misses, memrefs))
+      break;
+    i++;
   }
+  ReportClose(&report);
+  StatsClose(&stats, hits, misses, memrefs);
 
   PrintCache(hits, misses);
   fclose(file);
-  for (i = 0; i < numSets; ++i)
-    free(cache[i]);
-  
-  free(cache);
+  Release(&cache);
   return 0;
 }
 
 void OpenRequest(FILE **file) 
 {
   *file = fopen("request", "r");
-  if (!file) 
+  if (!*file)
   {
     printf("Error: No input file.\n");
     exit(1);
@@ -114,113 +465,2427 @@ void OpenRequest(FILE **file)
 
 void ReadRequest(FILE **file, int *numSets, int *setSize, int *lineSize) 
 {
-  char line[20];
-  
+  char line[64];
+
   fgets(line, sizeof(line), *file);
   sscanf(line, "%*[^:]: %d", numSets);
-  
+
   fgets(line, sizeof(line), *file);
   sscanf(line, "%*[^:]: %d", setSize);
-  
+
   fgets(line, sizeof(line), *file);
   sscanf(line, "%*[^:]: %d", lineSize);
 }
 
-void Initialize() 
+// Opens the trace on in, decompressing it on another thread if it is
+// gzip or zstd, in whichever dialect its first line is written
+Trace *OpenTrace(FILE *in)
+{
+  Trace *trace = (Trace*) calloc(1, sizeof(Trace));
+  in = traceDecompress(in);
+  if (!trace || !in)
+  {
+    fprintf(stderr, "Error: Could not open the trace\n");
+    exit(1);
+  }
+
+  trace->input = traceInputOpen(in, TRACE_DIALECT_UNKNOWN);
+  if (!trace->input)
+  {
+    fprintf(stderr, "Error: Unrecognized trace format\n");
+    exit(1);
+  }
+  return trace;
+}
+
+// Reads the next valid reference, reporting and skipping bad ones.
+// line is the number the next reference will get. Returns 0 at EOF.
+int ReadRef(Trace *in, MemRef *ref, int line)
+{
+  TraceRef *rec;
+
+  for (;;)
+  {
+    if (in->next == in->length)
+    {
+      in->length = traceInputRead(in->input, in->batch, TRACE_BATCH);
+      in->next = 0;
+      if (in->length < 0)
+        fprintf(stderr, "Error: Corrupt binary trace at line %d\n", line);
+      if (in->length <= 0)
+      {
+        in->length = 0;
+        return 0;
+      }
+    }
+
+    rec = &in->batch[in->next++];
+    if (rec->type == TRACE_INVALID)
+      continue;
+    (*ref).access = (rec->type == TRACE_WRITE) ? 'W' : (rec->type == TRACE_IFETCH) ? 'I' : 'R';
+    (*ref).size = rec->size;
+    (*ref).address = rec->address;
+
+    switch((*ref).size)
+    {
+      case 1:
+      case 2:
+      case 4:
+      case 8:
+        if ((*ref).address % (*ref).size != 0)
+        {
+          fprintf(stderr, "Error: Invalid size on line %d\n", line);
+          break;
+        }
+        return 1;
+
+      default:
+        fprintf(stderr, "Error: Invalid size on line %d\n", line);
+    }
+  }
+  return 0;
+}
+
+// Reads a whole trace into memory. Returns the number of references.
+long LoadTrace(Trace *in, MemRef **refs)
 {
-    int i, j;
-    cache = (Block**) malloc(numSets * sizeof(Block*));
-    for (i = 0; i < numSets; ++i)
-      cache[i] = (Block*) malloc(setSize * sizeof(Block));
-    
-    for (i = 0; i < numSets; ++i)
+  long n = 0, cap = 1 << 16;
+  *refs = (MemRef*) malloc(cap * sizeof(MemRef));
+  while (*refs && ReadRef(in, &(*refs)[n], (int)(n + 1)))
+    if (++n == cap)
     {
-      for (j = 0; j < setSize; ++j)
-        cache[i][j].valid = 0; 
-        cache[i][j].tag = 0; 
-        cache[i][j].dirty = 0;
-        cache[i][j].age = 0;
+      cap *= 2;
+      *refs = (MemRef*) realloc(*refs, cap * sizeof(MemRef));
     }
+  if (!*refs)
+  {
+    fprintf(stderr, "Error: Out of memory after %ld references\n", n);
+    exit(1);
+  }
+  return n;
 }
 
+int ParseWritePolicy(const char *name)
+{
+  int i;
+  for (i = 0; i < NUM_WRITE_POLICIES; ++i)
+    if (strcmp(name, writeNames[i]) == 0)
+      return i;
+  return -1;
+}
 
-int CacheRead(Trans *t, Block *b) 
+int ParsePolicy(const char *name)
 {
   int i;
-  for (i = 0; i < setSize; ++i)
-    if (cache[(*t).index][i].valid)
-      if (cache[(*t).index][i].tag == (*b).tag) 
-      {
-        (*t).memref = 0;
-        return 1;
-      }
-  return 0;
+  for (i = 0; i < NUM_POLICIES; ++i)
+    if (strcmp(name, policyNames[i]) == 0)
+      return i;
+  return -1;
 }
 
-void CacheWrite(Trans *t, Block *b) 
+void Initialize(Cache *c)
 {
-  int i; 
-  int LRU = 0;
-  (*t).memref = 1;
-  Block *loc = cache[(*t).index];
-  
-  for (i = 0; i < setSize; ++i)
-    ++loc[i].age;
-  
-  for (i = 0; i < setSize; ++i)
-    if (!loc[i].valid) 
-    {
-      loc[i].valid = 1;
-      loc[i].tag = (*b).tag;
-      loc[i].dirty = (*b).dirty;
-      loc[i].age = 0; 
-      return;
+  int i, j, ok, lines = c->numSets * c->setSize;
+
+  if (c->policy == PLRU && (c->setSize & (c->setSize - 1)) != 0)
+  {
+    fprintf(stderr, "Error: plru needs a power of 2 set size\n");
+    exit(1);
+  }
+  if (c->policy == PLRU && c->setSize > 64)
+  {
+    fprintf(stderr, "Error: plru supports at most 64 ways\n");
+    exit(1);
+  }
+  if (c->policy == DIP && c->numSets < DUEL_MIN_PERIOD)
+  {
+    fprintf(stderr, "Error: dip needs at least %d sets to duel\n", DUEL_MIN_PERIOD);
+    exit(1);
+  }
+
+  c->tagStride = (c->setSize + 7) & ~7;
+  c->maskWords = (c->tagStride + 63) / 64;
+  c->tags = (int32_t*) calloc((size_t)c->numSets * c->tagStride, sizeof(int32_t));
+  c->wideTags = NULL;
+  c->valid = (uint64_t*) calloc((size_t)c->numSets * c->maskWords, sizeof(uint64_t));
+  c->dirty = (uint64_t*) calloc((size_t)c->numSets * c->maskWords, sizeof(uint64_t));
+  c->filled = (int*) calloc(c->numSets, sizeof(int));
+  c->psel = PSEL_MAX / 2;
+  c->duelPeriod = c->numSets / DUEL_LEADERS;
+  if (c->duelPeriod < DUEL_MIN_PERIOD)
+    c->duelPeriod = DUEL_MIN_PERIOD;
+  ok = c->tags && c->valid && c->dirty && c->filled;
+
+  // Only the state the chosen policy uses is allocated; the rest stays
+  // NULL, which Release frees harmlessly
+  c->head = c->tail = c->prev = c->next = c->fifo = c->heap = c->heapPos = NULL;
+  c->plru = c->nextUse = NULL;
+  c->seed = c->count = NULL;
+  c->rrpv = NULL;
+  if (c->policy == LRU || c->policy == DIP)
+  {
+    c->head = (int*) malloc(c->numSets * sizeof(int));
+    c->tail = (int*) malloc(c->numSets * sizeof(int));
+    c->prev = (int*) malloc(lines * sizeof(int));
+    c->next = (int*) malloc(lines * sizeof(int));
+    ok = ok && c->head && c->tail && c->prev && c->next;
+  }
+  if (c->policy == PLRU)
+  {
+    c->plru = (uint64_t*) calloc(c->numSets, sizeof(uint64_t));
+    ok = ok && c->plru;
+  }
+  if (c->policy == FIFO)
+  {
+    c->fifo = (int*) calloc(c->numSets, sizeof(int));
+    ok = ok && c->fifo;
+  }
+  if (c->policy == RANDOM || c->policy == BRRIP || c->policy == DIP)
+  {
+    c->seed = (uint32_t*) malloc(c->numSets * sizeof(uint32_t));
+    ok = ok && c->seed;
+  }
+  if (c->policy == LFU)
+  {
+    c->count = (uint32_t*) calloc(lines, sizeof(uint32_t));
+    ok = ok && c->count;
+  }
+  if (c->policy == SRRIP || c->policy == BRRIP)
+  {
+    c->rrpv = (uint8_t*) malloc(lines * sizeof(uint8_t));
+    ok = ok && c->rrpv;
+  }
+  if (c->policy == OPT)
+  {
+    c->nextUse = (uint64_t*) malloc(lines * sizeof(uint64_t));
+    c->heap = (int*) malloc(lines * sizeof(int));
+    c->heapPos = (int*) malloc(lines * sizeof(int));
+    ok = ok && c->nextUse && c->heap && c->heapPos;
+  }
+
+  if (!ok)
+  {
+    fprintf(stderr, "Error: Out of memory for %d sets\n", c->numSets);
+    exit(1);
+  }
+
+  for (i = 0; i < c->numSets; ++i)
+  {
+    if (c->head)
+      c->head[i] = c->tail[i] = -1;
+    if (c->seed)
+    {
+      c->seed[i] = 2463534242u ^ (uint32_t)i * 2654435761u;
+      if (c->seed[i] == 0)
+        c->seed[i] = 1;
+    }
+    for (j = 0; j < c->setSize; ++j)
+    {
+      if (c->prev)
+        c->prev[i * c->setSize + j] = c->next[i * c->setSize + j] = -1;
+      if (c->rrpv)
+        c->rrpv[i * c->setSize + j] = RRPV_MAX;
+      if (c->heapPos)
+        c->heapPos[i * c->setSize + j] = -1;
     }
-  
-  for (i = 0; i < setSize; ++i)
-    if (loc[i].age > loc[LRU].age)
-      LRU = i;
-  
-  if (loc[LRU].dirty)
+  }
+}
+
+void Release(Cache *c)
+{
+  free(c->tags);
+  free(c->wideTags);
+  free(c->valid);
+  free(c->dirty);
+  free(c->filled);
+  free(c->head);
+  free(c->tail);
+  free(c->prev);
+  free(c->next);
+  free(c->plru);
+  free(c->fifo);
+  free(c->seed);
+  free(c->count);
+  free(c->rrpv);
+  free(c->nextUse);
+  free(c->heap);
+  free(c->heapPos);
+}
+
+// Moves every tag to 64 bits, the first time a tag does not fit in 32
+void WidenTags(Cache *c)
+{
+  size_t i, n = (size_t)c->numSets * c->tagStride;
+
+  c->wideTags = (uint64_t*) malloc(n * sizeof(uint64_t));
+  if (!c->wideTags)
+  {
+    fprintf(stderr, "Error: Out of memory for 64-bit tags\n");
+    exit(1);
+  }
+  for (i = 0; i < n; ++i)
+    c->wideTags[i] = (uint32_t)c->tags[i];
+  free(c->tags);
+  c->tags = NULL;
+}
+
+// Returns the valid way of a set holding tag, or -1
+static int LookupWay(Cache *c, int set, uint64_t tag)
+{
+  size_t base = (size_t)set * c->tagStride;
+  const uint64_t *valid = c->valid + (size_t)set * c->maskWords;
+
+  if (!c->wideTags && (tag >> 32))
+    WidenTags(c);
+  if (c->wideTags)
+    return FindWay64(c->wideTags + base, valid, c->tagStride, tag);
+  return FindWay(c->tags + base, valid, c->tagStride, (int32_t)(uint32_t)tag);
+}
+
+static void StoreTag(Cache *c, int set, int way, uint64_t tag)
+{
+  if (c->wideTags)
+    c->wideTags[(size_t)set * c->tagStride + way] = tag;
+  else
+    c->tags[(size_t)set * c->tagStride + way] = (int32_t)(uint32_t)tag;
+}
+
+static uint64_t LoadTag(Cache *c, int set, int way)
+{
+  if (c->wideTags)
+    return c->wideTags[(size_t)set * c->tagStride + way];
+  return (uint32_t)c->tags[(size_t)set * c->tagStride + way];
+}
+
+int CacheRead(Cache *c, Trans *t, Block *b)
+{
+  int i = LookupWay(c, (*t).index, (*b).tag);
+  if (i < 0)
+    return 0;
+
+  (*t).memref = 0;
+  (*t).way = i;
+  if ((*b).dirty)
+    c->dirty[(size_t)(*t).index * c->maskWords + i / 64] |= (uint64_t)1 << (i % 64);
+  PolicyTouch(c, (*t).index, i);
+  return 1;
+}
+
+void CacheWrite(Cache *c, Trans *t, Block *b)
+{
+  (*t).memref = 1;
+  uint64_t *valid = c->valid + (size_t)(*t).index * c->maskWords;
+  uint64_t *dirty = c->dirty + (size_t)(*t).index * c->maskWords;
+  int way;
+
+  if (c->filled[(*t).index] < c->setSize)
+    way = c->filled[(*t).index]++;
+  else
+    way = PolicyVictim(c, (*t).index);
+
+  uint64_t bit = (uint64_t)1 << (way % 64);
+  if ((valid[way / 64] & bit) && (dirty[way / 64] & bit))
     ++(*t).memref;
-  
-  loc[LRU].tag = (*b).tag;
-  loc[LRU].dirty = (*b).dirty;
-  loc[LRU].age = 0;
+
+  valid[way / 64] |= bit;
+  if ((*b).dirty)
+    dirty[way / 64] |= bit;
+  else
+    dirty[way / 64] &= ~bit;
+  StoreTag(c, (*t).index, way, (*b).tag);
+  (*t).way = way;
+  PolicyFill(c, (*t).index, way);
 }
 
-void Calculate(MemRef *m, Trans *t, Block *b) 
+void Calculate(Cache *c, MemRef *m, Trans *t, Block *b)
 {
-  int bits = (int)((log(lineSize) / log(2)));
+  int bits = (int)((log(c->lineSize) / log(2)));
   (*b).valid = 1;
-  (*b).tag = (*m).address >> (bits + (int)(log(numSets) / log(2)));
-  (*t).index = ((*m).address >> bits) % numSets;
-  (*t).offset = (*m).address % lineSize;
-  (*b).dirty = ((*m).access == 'R') ? 0 : 1;
+  (*b).tag = (*m).address >> (bits + (int)(log(c->numSets) / log(2)));
+  (*t).index = (int)(((*m).address >> bits) % c->numSets);
+  (*t).offset = (int)((*m).address % c->lineSize);
+  (*b).dirty = ((*m).access != 'W' || c->writePolicy == WRITE_THROUGH) ? 0 : 1;
 }
 
-void Layout() 
+// Runs one reference through the cache. Write-back caches only go to
+// memory on a miss or a dirty eviction; write-through caches also send
+// every write to memory.
+int Access(Cache *c, MemRef *m, Trans *t, Block *b)
 {
-  printf("Cache Configuration\n\n");
-  printf("   %d %d-way set associative entries\n", numSets, setSize);
-  printf("   of line size 8 bytes\n\n\n");
-  printf("Results for Each Reference\n\n");
-  printf("Ref  Access Address    Tag   Index Offset Result Memrefs\n");
-  printf("---- ------ -------- ------- ----- ------ ------ -------\n");
+  Calculate(c, m, t, b);
+
+  (*t).result = CacheRead(c, t, b);
+  if ((*t).result == 0)
+    CacheWrite(c, t, b);
+
+  if (c->writePolicy == WRITE_THROUGH && (*m).access == 'W')
+    ++(*t).memref;
+  return (*t).result;
+}
+
+//////////////////////////////
+// Tag Lookup Kernels
+//
+// Compare the tag against every way of a set at once. The SSE2 and AVX2
+// versions check 4 and 8 ways per instruction and mask the matches with
+// the set's valid bits; the 64-bit versions used once tags are widened
+// check half as many. SelectKernel picks the widest one the CPU
+// supports unless -k asks for a specific one.
+//////////////////////////////
+
+static int FindWayScalar(const int32_t *tags, const uint64_t *valid, int ways, int32_t tag)
+{
+  int i;
+  for (i = 0; i < ways; ++i)
+    if (((valid[i / 64] >> (i % 64)) & 1) && tags[i] == tag)
+      return i;
+  return -1;
+}
+
+static int FindWayScalar64(const uint64_t *tags, const uint64_t *valid, int ways, uint64_t tag)
+{
+  int i;
+  for (i = 0; i < ways; ++i)
+    if (((valid[i / 64] >> (i % 64)) & 1) && tags[i] == tag)
+      return i;
+  return -1;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static int FindWaySse2(const int32_t *tags, const uint64_t *valid, int ways, int32_t tag)
+{
+  __m128i key = _mm_set1_epi32(tag);
+  int i;
+  for (i = 0; i < ways; i += 4)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(tags + i));
+    unsigned m = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, key)));
+    m &= (unsigned)(valid[i / 64] >> (i % 64)) & 0xf;
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+  return -1;
+}
+
+__attribute__((target("avx2")))
+static int FindWayAvx2(const int32_t *tags, const uint64_t *valid, int ways, int32_t tag)
+{
+  __m256i key = _mm256_set1_epi32(tag);
+  int i;
+  for (i = 0; i < ways; i += 8)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(tags + i));
+    unsigned m = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, key)));
+    m &= (unsigned)(valid[i / 64] >> (i % 64)) & 0xff;
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+  return -1;
+}
+
+// SSE2 has no 64-bit compare, so both 32-bit halves must match
+__attribute__((target("sse2")))
+static int FindWaySse2_64(const uint64_t *tags, const uint64_t *valid, int ways, uint64_t tag)
+{
+  __m128i key = _mm_set1_epi64x((long long)tag);
+  int i;
+  for (i = 0; i < ways; i += 2)
+  {
+    __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(tags + i)), key);
+    eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+    unsigned m = (unsigned)_mm_movemask_pd(_mm_castsi128_pd(eq));
+    m &= (unsigned)(valid[i / 64] >> (i % 64)) & 0x3;
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+  return -1;
+}
+
+__attribute__((target("avx2")))
+static int FindWayAvx2_64(const uint64_t *tags, const uint64_t *valid, int ways, uint64_t tag)
+{
+  __m256i key = _mm256_set1_epi64x((long long)tag);
+  int i;
+  for (i = 0; i < ways; i += 4)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(tags + i));
+    unsigned m = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, key)));
+    m &= (unsigned)(valid[i / 64] >> (i % 64)) & 0xf;
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+  return -1;
+}
+#endif
+
+void SelectKernel(int kernel)
+{
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  int avx2 = __builtin_cpu_supports("avx2");
+  int sse2 = __builtin_cpu_supports("sse2");
+  if ((kernel == KERNEL_AVX2 && !avx2) || (kernel == KERNEL_SSE2 && !sse2))
+  {
+    fprintf(stderr, "Error: This CPU does not support the %s kernel\n", kernelNames[kernel]);
+    exit(1);
+  }
+  if (kernel == KERNEL_AVX2 || (kernel == KERNEL_AUTO && avx2))
+  {
+    FindWay = FindWayAvx2;
+    FindWay64 = FindWayAvx2_64;
+    return;
+  }
+  if (kernel == KERNEL_SSE2 || (kernel == KERNEL_AUTO && sse2))
+  {
+    FindWay = FindWaySse2;
+    FindWay64 = FindWaySse2_64;
+    return;
+  }
+#else
+  if (kernel == KERNEL_SSE2 || kernel == KERNEL_AVX2)
+  {
+    fprintf(stderr, "Error: The %s kernel needs an x86 build\n", kernelNames[kernel]);
+    exit(1);
+  }
+#endif
+  FindWay = FindWayScalar;
+  FindWay64 = FindWayScalar64;
+}
+
+//////////////////////////////
+// Replacement Policies
+//
+// Every policy keeps its own per-set state in the Cache and is driven
+// through three hooks: PolicyTouch on a hit, PolicyVictim to choose the
+// way to evict once a set is full, and PolicyFill after a line is
+// installed. LRU, PLRU, FIFO, RANDOM and DIP are O(1) (PLRU is
+// O(log ways)); LFU, SRRIP and BRRIP search the set on a miss. OPT keeps
+// each set's ways in a max-heap on next use, so its victim is the heap
+// root and every hook is O(log ways).
+//////////////////////////////
+
+static uint32_t NextRandom(Cache *c, int set)
+{
+  uint32_t x = c->seed[set];
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  c->seed[set] = x;
+  return x;
+}
+
+static void ListUnlink(Cache *c, int set, int line)
+{
+  int base = set * c->setSize;
+  if (c->prev[line] < 0 && c->head[set] != line - base)
+    return;  // not on the list yet
+  if (c->prev[line] >= 0)
+    c->next[base + c->prev[line]] = c->next[line];
+  else
+    c->head[set] = c->next[line];
+  if (c->next[line] >= 0)
+    c->prev[base + c->next[line]] = c->prev[line];
+  else
+    c->tail[set] = c->prev[line];
+  c->prev[line] = c->next[line] = -1;
+}
+
+static void ListPushHead(Cache *c, int set, int way)
+{
+  int base = set * c->setSize;
+  c->prev[base + way] = -1;
+  c->next[base + way] = c->head[set];
+  if (c->head[set] >= 0)
+    c->prev[base + c->head[set]] = way;
+  else
+    c->tail[set] = way;
+  c->head[set] = way;
+}
+
+static void ListPushTail(Cache *c, int set, int way)
+{
+  int base = set * c->setSize;
+  c->next[base + way] = -1;
+  c->prev[base + way] = c->tail[set];
+  if (c->tail[set] >= 0)
+    c->next[base + c->tail[set]] = way;
+  else
+    c->head[set] = way;
+  c->tail[set] = way;
+}
+
+// Point every tree node on the path to this way away from it
+static void PlruTouch(Cache *c, int set, int way)
+{
+  int node = 0, lo = 0, span = c->setSize;
+  while (span > 1)
+  {
+    span /= 2;
+    if (way < lo + span)
+    {
+      c->plru[set] |= (uint64_t)1 << node;
+      node = 2 * node + 1;
+    }
+    else
+    {
+      c->plru[set] &= ~((uint64_t)1 << node);
+      lo += span;
+      node = 2 * node + 2;
+    }
+  }
+}
+
+static int PlruVictim(Cache *c, int set)
+{
+  int node = 0, lo = 0, span = c->setSize;
+  while (span > 1)
+  {
+    span /= 2;
+    if ((c->plru[set] >> node) & 1)
+    {
+      lo += span;
+      node = 2 * node + 2;
+    }
+    else
+      node = 2 * node + 1;
+  }
+  return lo;
+}
+
+// Restores the OPT heap order around position pos after its key changed
+static void HeapFix(Cache *c, int set, int pos)
+{
+  int base = set * c->setSize, n = c->filled[set], way = c->heap[base + pos];
+  uint64_t key = c->nextUse[base + way];
+
+  while (pos > 0 && c->nextUse[base + c->heap[base + (pos - 1) / 2]] < key)
+  {
+    c->heap[base + pos] = c->heap[base + (pos - 1) / 2];
+    c->heapPos[base + c->heap[base + pos]] = pos;
+    pos = (pos - 1) / 2;
+  }
+  for (;;)
+  {
+    int child = 2 * pos + 1;
+    if (child >= n)
+      break;
+    if (child + 1 < n && c->nextUse[base + c->heap[base + child + 1]] > c->nextUse[base + c->heap[base + child]])
+      ++child;
+    if (c->nextUse[base + c->heap[base + child]] <= key)
+      break;
+    c->heap[base + pos] = c->heap[base + child];
+    c->heapPos[base + c->heap[base + pos]] = pos;
+    pos = child;
+  }
+  c->heap[base + pos] = way;
+  c->heapPos[base + way] = pos;
+}
+
+// DIP leader sets: 0 always uses LRU insertion, 1 always uses BIP. Every
+// duelPeriod sets hold one of each, so small caches still duel.
+static int DuelRole(const Cache *c, int set)
+{
+  if (set % c->duelPeriod == 0)
+    return 0;
+  if (set % c->duelPeriod == c->duelPeriod / 2 + 1)
+    return 1;
+  return -1;
+}
+
+void PolicyTouch(Cache *c, int set, int way)
+{
+  int line = set * c->setSize + way;
+  switch (c->policy)
+  {
+    case LRU:
+    case DIP:
+      ListUnlink(c, set, line);
+      ListPushHead(c, set, way);
+      break;
+    case PLRU:
+      PlruTouch(c, set, way);
+      break;
+    case LFU:
+      ++c->count[line];
+      break;
+    case SRRIP:
+    case BRRIP:
+      c->rrpv[line] = 0;
+      break;
+    case OPT:
+      c->nextUse[line] = c->upcoming;
+      HeapFix(c, set, c->heapPos[line]);
+      break;
+  }
+}
+
+int PolicyVictim(Cache *c, int set)
+{
+  int i, base = set * c->setSize, way = 0;
+  switch (c->policy)
+  {
+    case LRU:
+    case DIP:
+      way = c->tail[set];
+      break;
+    case PLRU:
+      way = PlruVictim(c, set);
+      break;
+    case FIFO:
+      way = c->fifo[set];
+      break;
+    case RANDOM:
+      way = NextRandom(c, set) % c->setSize;
+      break;
+    case LFU:
+      for (i = 1; i < c->setSize; ++i)
+        if (c->count[base + i] < c->count[base + way])
+          way = i;
+      break;
+    case SRRIP:
+    case BRRIP:
+      for (;;)
+      {
+        for (i = 0; i < c->setSize; ++i)
+          if (c->rrpv[base + i] == RRPV_MAX)
+            return i;
+        for (i = 0; i < c->setSize; ++i)
+          ++c->rrpv[base + i];
+      }
+    case OPT:
+      way = c->heap[base];
+      break;
+  }
+  return way;
+}
+
+void PolicyFill(Cache *c, int set, int way)
+{
+  int line = set * c->setSize + way;
+  int role, bip;
+  switch (c->policy)
+  {
+    case LRU:
+      ListUnlink(c, set, line);
+      ListPushHead(c, set, way);
+      break;
+    case DIP:
+      role = DuelRole(c, set);
+      if (role == 0 && c->psel < PSEL_MAX)
+        ++c->psel;
+      else if (role == 1 && c->psel > 0)
+        --c->psel;
+      bip = (role == 1) || (role < 0 && c->psel > PSEL_MAX / 2);
+      ListUnlink(c, set, line);
+      if (bip && NextRandom(c, set) % BIMODAL != 0)
+        ListPushTail(c, set, way);
+      else
+        ListPushHead(c, set, way);
+      break;
+    case PLRU:
+      PlruTouch(c, set, way);
+      break;
+    case FIFO:
+      if (way == c->fifo[set])
+        c->fifo[set] = (way + 1) % c->setSize;
+      break;
+    case LFU:
+      c->count[line] = 1;
+      break;
+    case SRRIP:
+      c->rrpv[line] = RRPV_MAX - 1;
+      break;
+    case BRRIP:
+      c->rrpv[line] = (NextRandom(c, set) % BIMODAL == 0) ? RRPV_MAX - 1 : RRPV_MAX;
+      break;
+    case OPT:
+      // Ways join the heap as the set fills, at its last position
+      if (c->heapPos[line] < 0)
+      {
+        c->heapPos[line] = c->filled[set] - 1;
+        c->heap[set * c->setSize + c->heapPos[line]] = way;
+      }
+      c->nextUse[line] = c->upcoming;
+      HeapFix(c, set, c->heapPos[line]);
+      break;
+  }
+}
+
+//////////////////////////////
+// Stack Distance
+//
+// One pass computes the LRU stack distance of every reference: the
+// number of distinct lines touched since the previous reference to the
+// same line. A fully associative LRU cache of C lines hits exactly the
+// references with distance < C, so the histogram gives the miss ratio of
+// every size at once. Each line's last access time is kept in a hash
+// map, and a Fenwick tree over time marks the times that are still some
+// line's most recent access, so a distance is one O(log n) range count.
+//////////////////////////////
+
+typedef struct{
+  uint64_t *keys;
+  long *values;        // 0 marks an empty slot
+  long mask, used;
+} LineMap;
+
+static void LineMapInit(LineMap *map, long capacity)
+{
+  long size = 16;
+  while (size < 2 * capacity)
+    size *= 2;
+  map->keys = (uint64_t*) malloc(size * sizeof(uint64_t));
+  map->values = (long*) calloc(size, sizeof(long));
+  map->mask = size - 1;
+  map->used = 0;
+  if (!map->keys || !map->values)
+  {
+    fprintf(stderr, "Error: Out of memory for %ld lines\n", capacity);
+    exit(1);
+  }
+}
+
+static void LineMapFree(LineMap *map)
+{
+  free(map->keys);
+  free(map->values);
+}
+
+static long LineMapHome(LineMap *map, uint64_t key)
+{
+  return (long)((key * 0x9E3779B97F4A7C15ull) >> 20) & map->mask;
+}
+
+// Returns the value slot for key, inserting an empty one if needed
+static long *LineMapSlot(LineMap *map, uint64_t key)
+{
+  long i = LineMapHome(map, key);
+  while (map->values[i] != 0 && map->keys[i] != key)
+    i = (i + 1) & map->mask;
+  if (map->values[i] == 0)
+    map->keys[i] = key;
+  return &map->values[i];
+}
+
+// Doubles the table once it is half full, for maps whose final size is
+// not known up front
+static void LineMapGrow(LineMap *map)
+{
+  LineMap bigger;
+  long i;
+
+  if (2 * map->used <= map->mask + 1)
+    return;
+  LineMapInit(&bigger, map->mask + 1);
+  for (i = 0; i <= map->mask; ++i)
+    if (map->values[i] != 0)
+      *LineMapSlot(&bigger, map->keys[i]) = map->values[i];
+  bigger.used = map->used;
+  LineMapFree(map);
+  *map = bigger;
+}
+
+// Deletes key, which must be present, shifting later entries of its
+// probe run back so lookups never need tombstones
+static void LineMapRemove(LineMap *map, uint64_t key)
+{
+  long i = LineMapHome(map, key), j, home;
+
+  while (map->keys[i] != key || map->values[i] == 0)
+    i = (i + 1) & map->mask;
+  for (j = i; ; )
+  {
+    map->values[i] = 0;
+    do
+    {
+      j = (j + 1) & map->mask;
+      if (map->values[j] == 0)
+      {
+        --map->used;
+        return;
+      }
+      home = LineMapHome(map, map->keys[j]);
+    } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+    map->keys[i] = map->keys[j];
+    map->values[i] = map->values[j];
+    i = j;
+  }
+}
+
+static void FenwickAdd(long *tree, long n, long i, long delta)
+{
+  for (; i <= n; i += i & -i)
+    tree[i] += delta;
+}
+
+static long FenwickSum(long *tree, long i)
+{
+  long sum = 0;
+  for (; i > 0; i -= i & -i)
+    sum += tree[i];
+  return sum;
+}
+
+void StackDistance(MemRef *refs, long n, int lineSize)
+{
+  int bits = (int)((log(lineSize) / log(2)));
+  long *tree = (long*) calloc(n + 1, sizeof(long));
+  long *hist = (long*) calloc(n + 1, sizeof(long));
+  long i, d, cold = 0, distinct, maxDistance = 0, size, misses;
+  LineMap last;
+
+  if (!tree || !hist)
+  {
+    fprintf(stderr, "Error: Out of memory for %ld references\n", n);
+    exit(1);
+  }
+  LineMapInit(&last, n);
+
+  for (i = 1; i <= n; ++i)
+  {
+    long *slot = LineMapSlot(&last, refs[i - 1].address >> bits);
+    if (*slot == 0)
+    {
+      ++cold;
+      ++last.used;
+    }
+    else
+    {
+      d = FenwickSum(tree, i - 1) - FenwickSum(tree, *slot);
+      ++hist[d];
+      if (d > maxDistance)
+        maxDistance = d;
+      FenwickAdd(tree, n, *slot, -1);
+    }
+    FenwickAdd(tree, n, i, 1);
+    *slot = i;
+  }
+  distinct = last.used;
+
+  printf("Stack Distance Profile\n\n");
+  printf("   %ld references to %ld distinct lines of %d bytes\n\n\n", n, distinct, lineSize);
+  printf("Fully Associative LRU Miss Ratio Curve\n\n");
+  printf("   Lines       Bytes     Misses Miss Ratio\n");
+  printf("-------- ----------- ---------- ----------\n");
+
+  // Misses at size C: cold misses plus every distance >= C
+  misses = n;
+  d = 0;
+  for (size = 1; ; size *= 2)
+  {
+    for (; d < size && d <= maxDistance; ++d)
+      misses -= hist[d];
+    printf("%8ld %11ld %10ld %10f\n", size, size * lineSize, misses, n ? (double)misses / n : 0.0);
+    if (size > maxDistance)
+      break;
+  }
+  printf("\n\nCompulsory misses: %ld\n\n", cold);
+
+  LineMapFree(&last);
+  free(tree);
+  free(hist);
+}
+
+//////////////////////////////
+// All-Associativity Simulation
+//
+// In the style of Hill and Smith, one pass over the trace simulates
+// every power of 2 set count from 1 up to the request's number of sets,
+// at every associativity up to MAX_ALL_WAYS, all with LRU replacement.
+// For each set count, every set keeps an LRU stack of its most recent
+// MAX_ALL_WAYS lines. A reference found at depth p hits in every cache
+// of that set count with more than p ways. So one stack search per set
+// count gives the outcome for all associativities, and each reference
+// costs O(log sets * MAX_ALL_WAYS).
+//////////////////////////////
+
+void AllAssociativity(Trace *in, int maxSets, int lineSize)
+{
+  int bits = (int)((log(lineSize) / log(2)));
+  int levels = 0, k, p, w, i = 1;
+  long n = 0;
+  MemRef ref;
+
+  while ((2 << levels) <= maxSets)
+    ++levels;
+
+  // stacks[k] holds 2^k sets of MAX_ALL_WAYS lines, most recent first;
+  // depth[k][p] counts references found at depth p
+  uint64_t **stacks = (uint64_t**) malloc((levels + 1) * sizeof(uint64_t*));
+  uint8_t **sizes = (uint8_t**) malloc((levels + 1) * sizeof(uint8_t*));
+  long (*depth)[MAX_ALL_WAYS] = calloc(levels + 1, sizeof(*depth));
+  if (!stacks || !sizes || !depth)
+  {
+    fprintf(stderr, "Error: Out of memory for %d set counts\n", levels + 1);
+    exit(1);
+  }
+  for (k = 0; k <= levels; ++k)
+  {
+    stacks[k] = (uint64_t*) malloc(((size_t)1 << k) * MAX_ALL_WAYS * sizeof(uint64_t));
+    sizes[k] = (uint8_t*) calloc((size_t)1 << k, sizeof(uint8_t));
+    if (!stacks[k] || !sizes[k])
+    {
+      fprintf(stderr, "Error: Out of memory for %d sets\n", 1 << k);
+      exit(1);
+    }
+  }
+
+  while (ReadRef(in, &ref, i++))
+  {
+    uint64_t line = ref.address >> bits;
+    ++n;
+    for (k = 0; k <= levels; ++k)
+    {
+      size_t set = (size_t)(line & (((uint64_t)1 << k) - 1));
+      uint64_t *stack = stacks[k] + set * MAX_ALL_WAYS;
+      int used = sizes[k][set];
+
+      for (p = 0; p < used && stack[p] != line; ++p)
+        ;
+      if (p < used)
+        ++depth[k][p];
+      else if (used < MAX_ALL_WAYS)
+        sizes[k][set] = (uint8_t)++used;
+      else
+        p = MAX_ALL_WAYS - 1;  // drop the least recent line
+
+      memmove(stack + 1, stack, p * sizeof(uint64_t));
+      stack[0] = line;
+    }
+  }
+
+  printf("All-Associativity Simulation\n\n");
+  printf("   %ld references, LRU, line size %d bytes\n\n\n", n, lineSize);
+  printf("Miss Ratio by Sets and Ways\n\n");
+  printf("    Sets");
+  for (w = 1; w <= MAX_ALL_WAYS; w *= 2)
+    printf(" %8d-way", w);
+  printf("\n--------");
+  for (w = 1; w <= MAX_ALL_WAYS; w *= 2)
+    printf(" ------------");
+  printf("\n");
+
+  for (k = 0; k <= levels; ++k)
+  {
+    long hits = 0;
+    printf("%8d", 1 << k);
+    for (p = 0, w = 1; w <= MAX_ALL_WAYS; w *= 2)
+    {
+      for (; p < w; ++p)
+        hits += depth[k][p];
+      printf(" %12f", n ? (double)(n - hits) / n : 0.0);
+    }
+    printf("\n");
+  }
+  printf("\n");
+
+  for (k = 0; k <= levels; ++k)
+  {
+    free(stacks[k]);
+    free(sizes[k]);
+  }
+  free(stacks);
+  free(sizes);
+  free(depth);
+}
+
+//////////////////////////////
+// Three C Miss Classification
+//
+// Runs the configured cache and, alongside it, a fully associative LRU
+// shadow cache with the same number of lines. Each miss in the
+// configured cache is then
+//
+//   compulsory  the first reference to its line
+//   capacity    also a miss in the shadow cache
+//   conflict    a hit in the shadow cache
+//
+// Lines seen so far are kept in a growing hash set. The shadow is a hash
+// map from line to a node in a doubly linked recency list, so a hit,
+// fill or eviction is O(1) whatever the cache size.
+//////////////////////////////
+
+typedef struct{
+  int capacity, used;
+  int head, tail;      // MRU and LRU nodes, -1 while empty
+  int *prev, *next;
+  uint64_t *lines;     // line held by each node
+  LineMap where;       // line -> node + 1
+} Shadow;
+
+static void ShadowInit(Shadow *s, int capacity)
+{
+  s->capacity = capacity;
+  s->used = 0;
+  s->head = s->tail = -1;
+  s->prev = (int*) malloc(capacity * sizeof(int));
+  s->next = (int*) malloc(capacity * sizeof(int));
+  s->lines = (uint64_t*) malloc(capacity * sizeof(uint64_t));
+  if (!s->prev || !s->next || !s->lines)
+  {
+    fprintf(stderr, "Error: Out of memory for %d shadow lines\n", capacity);
+    exit(1);
+  }
+  LineMapInit(&s->where, capacity);
+}
+
+static void ShadowFree(Shadow *s)
+{
+  free(s->prev);
+  free(s->next);
+  free(s->lines);
+  LineMapFree(&s->where);
+}
+
+static void ShadowUnlink(Shadow *s, int node)
+{
+  if (s->prev[node] >= 0)
+    s->next[s->prev[node]] = s->next[node];
+  else
+    s->head = s->next[node];
+  if (s->next[node] >= 0)
+    s->prev[s->next[node]] = s->prev[node];
+  else
+    s->tail = s->prev[node];
+}
+
+static void ShadowPushHead(Shadow *s, int node)
+{
+  s->prev[node] = -1;
+  s->next[node] = s->head;
+  if (s->head >= 0)
+    s->prev[s->head] = node;
+  else
+    s->tail = node;
+  s->head = node;
+}
+
+// Returns 1 if line hits in the shadow cache, and makes it the MRU line
+static int ShadowAccess(Shadow *s, uint64_t line)
+{
+  long *slot = LineMapSlot(&s->where, line);
+  int node;
+
+  if (*slot != 0)
+  {
+    node = (int)(*slot - 1);
+    if (node != s->head)
+    {
+      ShadowUnlink(s, node);
+      ShadowPushHead(s, node);
+    }
+    return 1;
+  }
+
+  if (s->used < s->capacity)
+  {
+    node = s->used++;
+    ++s->where.used;
+  }
+  else
+  {
+    // Reuse the LRU node. Removing its line may shift entries, so the
+    // new line's slot is looked up again afterwards
+    node = s->tail;
+    ShadowUnlink(s, node);
+    LineMapRemove(&s->where, s->lines[node]);
+    slot = LineMapSlot(&s->where, line);
+    ++s->where.used;
+  }
+  *slot = node + 1;
+  s->lines[node] = line;
+  ShadowPushHead(s, node);
+  return 0;
+}
+
+void Classify(Trace *in, Cache *c)
+{
+  int bits = (int)((log(c->lineSize) / log(2)));
+  int i = 1;
+  long hits = 0, compulsory = 0, capacity = 0, conflict = 0, shadowOnly = 0;
+  LineMap seen;
+  Shadow shadow;
+  MemRef ref;
+  Trans t;
+  Block b;
+
+  Initialize(c);
+  LineMapInit(&seen, 1024);
+  ShadowInit(&shadow, c->numSets * c->setSize);
+
+  while (ReadRef(in, &ref, i++))
+  {
+    uint64_t line = ref.address >> bits;
+    int hit = Access(c, &ref, &t, &b);
+    int shadowHit = ShadowAccess(&shadow, line);
+    long *first = LineMapSlot(&seen, line);
+
+    if (*first == 0)
+    {
+      *first = 1;
+      ++seen.used;
+      LineMapGrow(&seen);
+      ++compulsory;
+    }
+    else if (hit)
+    {
+      ++hits;
+      if (!shadowHit)
+        ++shadowOnly;
+    }
+    else if (shadowHit)
+      ++conflict;
+    else
+      ++capacity;
+  }
+
+  long misses = compulsory + capacity + conflict, n = hits + misses;
+
+  printf("Three C Miss Classification\n\n");
+  printf("   %d %d-way set associative entries\n", c->numSets, c->setSize);
+  printf("   of line size %d bytes\n", c->lineSize);
+  printf("   with %s replacement\n", policyNames[c->policy]);
+  printf("   against a %d-line fully associative LRU cache\n\n\n", shadow.capacity);
+  printf("Miss Type      Misses Of Misses Of Accesses\n");
+  printf("---------- ---------- --------- -----------\n");
+  printf("Compulsory %10ld %9f %11f\n", compulsory, misses ? (double)compulsory / misses : 0.0, n ? (double)compulsory / n : 0.0);
+  printf("Capacity   %10ld %9f %11f\n", capacity, misses ? (double)capacity / misses : 0.0, n ? (double)capacity / n : 0.0);
+  printf("Conflict   %10ld %9f %11f\n", conflict, misses ? (double)conflict / misses : 0.0, n ? (double)conflict / n : 0.0);
+  printf("Total      %10ld %9f %11f\n", misses, misses ? 1.0 : 0.0, n ? (double)misses / n : 0.0);
+  printf("\n\nTotal Hits: %ld\n", hits);
+  printf("Total Accesses: %ld\n", n);
+  printf("Hits the fully associative cache misses: %ld\n\n", shadowOnly);
+
+  LineMapFree(&seen);
+  ShadowFree(&shadow);
+  Release(c);
+}
+
+//////////////////////////////
+// Belady's Optimal Replacement
+//
+// OPT evicts the line whose next reference is furthest in the future,
+// so it needs the whole trace before simulating. The references are
+// spilled to an unlinked temporary file in $TMPDIR (default /tmp) and
+// memory mapped. A backward pass then fills in every reference's next
+// use from a hash map of each line's next reference, and a forward pass
+// simulates. Only the map and the cache have to stay resident; the page
+// cache streams the references, so traces far larger than memory work.
+//////////////////////////////
+
+#define OPT_WRITE ((uint64_t)1 << 63)  // access flag kept beside the next use
+#define OPT_NEVER (OPT_WRITE - 1)      // next use of a line never seen again
+
+typedef struct{
+  uint64_t address;
+  uint64_t next;       // next use, or'd with OPT_WRITE for writes
+} OptRef;
+
+// Spills the trace to a mapped temporary file. Returns NULL for an empty
+// trace
+static OptRef *SpillTrace(Trace *in, long *count, size_t *bytes)
+{
+  const char *dir = getenv("TMPDIR");
+  char path[4096];
+  OptRef *refs = NULL;
+  MemRef ref;
+  FILE *spill;
+  int fd, i = 1;
+
+  snprintf(path, sizeof(path), "%s/drew-opt-XXXXXX", dir && *dir ? dir : "/tmp");
+  fd = mkstemp(path);
+  spill = fd >= 0 ? fdopen(fd, "w+") : NULL;
+  if (!spill)
+  {
+    fprintf(stderr, "Error: Could not create a temporary file in %s\n", dir && *dir ? dir : "/tmp");
+    exit(1);
+  }
+  unlink(path);
+
+  *count = 0;
+  while (ReadRef(in, &ref, i++))
+  {
+    OptRef r = { ref.address, ref.access == 'W' ? OPT_WRITE : 0 };
+    if (fwrite(&r, sizeof(r), 1, spill) != 1)
+    {
+      fprintf(stderr, "Error: Could not spill the trace to %s\n", path);
+      exit(1);
+    }
+    ++*count;
+  }
+  if (fflush(spill) != 0)
+  {
+    fprintf(stderr, "Error: Could not spill the trace to %s\n", path);
+    exit(1);
+  }
+
+  *bytes = (size_t)*count * sizeof(OptRef);
+  if (*count)
+  {
+    refs = (OptRef*) mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(spill), 0);
+    if (refs == MAP_FAILED)
+    {
+      fprintf(stderr, "Error: Could not map %ld spilled references\n", *count);
+      exit(1);
+    }
+  }
+  fclose(spill);  // the mapping keeps the file alive
+  return refs;
+}
+
+void Optimal(Trace *in, Cache *c, Report *r, Stats *s)
+{
+  int bits = (int)((log(c->lineSize) / log(2)));
+  int hits = 0, misses = 0;
+  long n, k, memrefs = 0;
+  size_t bytes;
+  OptRef *refs = SpillTrace(in, &n, &bytes);
+  LineMap next;
+  MemRef ref;
+  Trans t;
+  Block b;
+
+  // Backward pass: each line's next reference so far, as index + 1
+  LineMapInit(&next, 1024);
+  for (k = n - 1; k >= 0; --k)
+  {
+    long *slot = LineMapSlot(&next, refs[k].address >> bits);
+    uint64_t use = *slot ? (uint64_t)(*slot - 1) : OPT_NEVER;
+    refs[k].next = (refs[k].next & OPT_WRITE) | use;
+    if (*slot == 0)
+      ++next.used;
+    *slot = k + 1;
+    LineMapGrow(&next);
+  }
+  LineMapFree(&next);
+
+  Initialize(c);
+  Layout(c, r);
+  ReportOpen(r);
+  ref.size = 0;
+  for (k = 0; k < n; ++k)
+  {
+    ref.access = (refs[k].next & OPT_WRITE) ? 'W' : 'R';
+    ref.address = refs[k].address;
+    c->upcoming = refs[k].next & ~OPT_WRITE;
+    if (Access(c, &ref, &t, &b))
+      hits++;
+    else
+      misses++;
+
+    PrintData(r, (int)(k + 1), &ref, &t, &b);
+    memrefs += t.memref;
+    if (k + 1 == s->next && Snapshot(s, hits, misses, memrefs))
+      break;
+  }
+  ReportClose(r);
+  StatsClose(s, hits, misses, memrefs);
+
+  PrintCache(hits, misses);
+  Release(c);
+  if (refs)
+    munmap(refs, bytes);
+}
+
+//////////////////////////////
+// Configuration Sweep
+//
+// Parses the trace once into memory, then simulates every configuration
+// in the sweep file against it on a pool of worker threads. Each line of
+// the sweep file is
+//
+//   <sets> <ways> <line size> [policy] [write policy]
+//
+// and # starts a comment. Each job builds its own Cache, so the workers
+// share nothing but the read-only trace and the next-job counter.
+//////////////////////////////
+
+typedef struct{
+  Cache cache;
+  long hits, misses, memrefs;
+} SweepJob;
+
+typedef struct{
+  SweepJob *jobs;
+  int numJobs;
+  atomic_int nextJob;
+  MemRef *refs;
+  long numRefs;
+} SweepPool;
+
+static void *SweepWorker(void *arg)
+{
+  SweepPool *pool = (SweepPool*) arg;
+  int j;
+  long r, hits, misses, memrefs;
+  Cache cache;
+  Trans t;
+  Block b;
+
+  // Jobs sit next to each other in one array, so the cache and the
+  // counters are worked on in locals and stored once at the end;
+  // writing through job on every reference would bounce its cache
+  // lines between the threads running neighbouring jobs
+  while ((j = atomic_fetch_add(&pool->nextJob, 1)) < pool->numJobs)
+  {
+    SweepJob *job = &pool->jobs[j];
+    cache = job->cache;
+    hits = misses = memrefs = 0;
+    Initialize(&cache);
+    for (r = 0; r < pool->numRefs; ++r)
+    {
+      if (Access(&cache, &pool->refs[r], &t, &b))
+        ++hits;
+      else
+        ++misses;
+      memrefs += t.memref;
+    }
+    Release(&cache);
+    job->hits = hits;
+    job->misses = misses;
+    job->memrefs = memrefs;
+  }
+  return NULL;
+}
+
+static int IsPowerOfTwo(int n)
+{
+  return n > 0 && (n & (n - 1)) == 0;
+}
+
+void Sweep(Trace *in, const char *sweepFile, int threads)
+{
+  FILE *list = fopen(sweepFile, "r");
+  char line[128], policy[16], write[16];
+  int cap = 16, lineNo = 0, i;
+  SweepPool pool;
+
+  if (!list)
+  {
+    fprintf(stderr, "Error: Could not open sweep file %s\n", sweepFile);
+    exit(1);
+  }
+
+  pool.jobs = (SweepJob*) malloc(cap * sizeof(SweepJob));
+  pool.numJobs = 0;
+  while (pool.jobs && fgets(line, sizeof(line), list))
+  {
+    SweepJob job;
+    int fields;
+
+    ++lineNo;
+    line[strcspn(line, "#")] = '\0';
+    strcpy(policy, "fifo");
+    strcpy(write, "wb");
+    memset(&job, 0, sizeof(job));
+    fields = sscanf(line, "%d %d %d %15s %15s", &job.cache.numSets, &job.cache.setSize,
+                    &job.cache.lineSize, policy, write);
+    if (fields <= 0)
+      continue;
+    job.cache.policy = ParsePolicy(policy);
+    job.cache.writePolicy = ParseWritePolicy(write);
+    if (fields < 3 || !IsPowerOfTwo(job.cache.numSets) || job.cache.setSize < 1 ||
+        !IsPowerOfTwo(job.cache.lineSize) || job.cache.policy < 0 || job.cache.policy == OPT || job.cache.writePolicy < 0 ||
+        (job.cache.policy == PLRU && (!IsPowerOfTwo(job.cache.setSize) || job.cache.setSize > 64)))
+    {
+      fprintf(stderr, "Error: Bad configuration on line %d of %s\n", lineNo, sweepFile);
+      exit(1);
+    }
+
+    if (pool.numJobs == cap)
+    {
+      cap *= 2;
+      pool.jobs = (SweepJob*) realloc(pool.jobs, cap * sizeof(SweepJob));
+      if (!pool.jobs)
+        break;
+    }
+    pool.jobs[pool.numJobs++] = job;
+  }
+  fclose(list);
+  if (!pool.jobs)
+  {
+    fprintf(stderr, "Error: Out of memory for sweep configurations\n");
+    exit(1);
+  }
+
+  pool.numRefs = LoadTrace(in, &pool.refs);
+  atomic_init(&pool.nextJob, 0);
+
+  if (threads > pool.numJobs)
+    threads = pool.numJobs;
+  pthread_t *workers = (pthread_t*) malloc((threads > 0 ? threads : 1) * sizeof(pthread_t));
+  for (i = 0; i < threads; ++i)
+    if (pthread_create(&workers[i], NULL, SweepWorker, &pool) != 0)
+    {
+      fprintf(stderr, "Error: Could not start worker thread\n");
+      exit(1);
+    }
+  for (i = 0; i < threads; ++i)
+    pthread_join(workers[i], NULL);
+
+  printf("Configuration Sweep\n\n");
+  printf("   %ld references, %d configurations, %d threads\n\n\n", pool.numRefs, pool.numJobs, threads);
+  printf("    Sets Ways Line Policy Write       Hits     Misses Miss Ratio    Memrefs\n");
+  printf("-------- ---- ---- ------ ----- ---------- ---------- ---------- ----------\n");
+  for (i = 0; i < pool.numJobs; ++i)
+  {
+    SweepJob *job = &pool.jobs[i];
+    printf("%8d %4d %4d %6s %5s %10ld %10ld %10f %10ld\n",
+      job->cache.numSets, job->cache.setSize, job->cache.lineSize,
+      policyNames[job->cache.policy], writeNames[job->cache.writePolicy],
+      job->hits, job->misses,
+      pool.numRefs ? (double)job->misses / pool.numRefs : 0.0,
+      job->memrefs);
+  }
+  printf("\n");
+
+  free(workers);
+  free(pool.jobs);
+  free(pool.refs);
+}
+
+//////////////////////////////
+// Cache Hierarchy
+//
+// Simulates split L1 instruction and data caches over a unified L2 and
+// an optional L3, all write-back and write-allocate with one line size.
+// Instruction fetches go to the L1I and reads and writes to the L1D. The
+// -L file has one line per level,
+//
+//   <l1i|l1d|l2|l3> <sets> <ways> <line size> <latency> [policy] [inclusion]
+//
+// plus "memory <latency>", and # starts a comment. The inclusion of L2
+// and L3 (default nine) says how each relates to the levels above it:
+//
+//   inclusive  filled on a miss; evicting a line back-invalidates it
+//              above, so everything above is also held here
+//   exclusive  filled only by lines evicted from above; a hit moves the
+//              line up and out of this level
+//   nine       filled on a miss, evicted without back-invalidation
+//
+// A level's latency is paid by every reference that looks it up, so the
+// average of those sums is the AMAT.
+//////////////////////////////
+
+#define MAX_LEVELS 4
+
+typedef struct{
+  const char *name;
+  int depth;           // 0 for the L1s, 1 for L2, 2 for L3
+  int present;
+  int latency;
+  int inclusion;
+  Cache cache;
+  long accesses, hits, misses;
+  long writebacks;     // dirty lines written to the level below
+  long backInvalidations;
+} Level;
+
+typedef struct{
+  Level levels[MAX_LEVELS];  // L1I, L1D, L2, L3
+  int depths;                // L1 + L2 (+ L3)
+  int memoryLatency;
+  long memoryReads, memoryWrites;
+} Hier;
+
+static Level *LevelAt(Hier *h, int depth)
+{
+  return &h->levels[depth + 1];
+}
+
+static int LevelSet(Cache *c, uint64_t line)
+{
+  return (int)(line % (uint64_t)c->numSets);
+}
+
+// Looks line up and makes it most recently used. Returns the way or -1
+static int LevelFind(Level *l, uint64_t line)
+{
+  Cache *c = &l->cache;
+  int set = LevelSet(c, line);
+  int way = LookupWay(c, set, line / (uint64_t)c->numSets);
+  if (way >= 0)
+    PolicyTouch(c, set, way);
+  return way;
+}
+
+static void LevelMarkDirty(Level *l, uint64_t line, int way)
+{
+  Cache *c = &l->cache;
+  c->dirty[(size_t)LevelSet(c, line) * c->maskWords + way / 64] |= (uint64_t)1 << (way % 64);
+}
+
+// Drops line if it is present. Returns 1 if the dropped copy was dirty,
+// 0 if it was clean and -1 if it was not there
+static int LevelInvalidate(Level *l, uint64_t line)
+{
+  Cache *c = &l->cache;
+  int set = LevelSet(c, line);
+  int way = LookupWay(c, set, line / (uint64_t)c->numSets);
+  size_t word;
+  uint64_t bit;
+  int dirty;
+
+  if (way < 0)
+    return -1;
+  word = (size_t)set * c->maskWords + way / 64;
+  bit = (uint64_t)1 << (way % 64);
+  dirty = (c->dirty[word] & bit) != 0;
+  c->valid[word] &= ~bit;
+  c->dirty[word] &= ~bit;
+  return dirty;
+}
+
+// Installs line, preferring a way emptied by invalidation over evicting.
+// Returns 1 and sets *victim and *victimDirty if a valid line was evicted
+static int LevelInstall(Level *l, uint64_t line, int dirty, uint64_t *victim, int *victimDirty)
+{
+  Cache *c = &l->cache;
+  int set = LevelSet(c, line), way, evicted = 0;
+  uint64_t *valid = c->valid + (size_t)set * c->maskWords;
+  uint64_t *dirtyBits = c->dirty + (size_t)set * c->maskWords;
+  uint64_t bit;
+
+  if (c->filled[set] < c->setSize)
+    way = c->filled[set]++;
+  else
+  {
+    for (way = 0; way < c->setSize && ((valid[way / 64] >> (way % 64)) & 1); ++way)
+      ;
+    if (way == c->setSize)
+    {
+      way = PolicyVictim(c, set);
+      *victim = LoadTag(c, set, way) * (uint64_t)c->numSets + (uint64_t)set;
+      *victimDirty = (int)((dirtyBits[way / 64] >> (way % 64)) & 1);
+      evicted = 1;
+    }
+  }
+
+  bit = (uint64_t)1 << (way % 64);
+  valid[way / 64] |= bit;
+  if (dirty)
+    dirtyBits[way / 64] |= bit;
+  else
+    dirtyBits[way / 64] &= ~bit;
+  StoreTag(c, set, way, line / (uint64_t)c->numSets);
+  PolicyFill(c, set, way);
+  return evicted;
+}
+
+static void HierEvict(Hier *h, Level *from, uint64_t line, int dirty);
+
+// Puts line into level l, sending its victim down through HierEvict
+static void HierFill(Hier *h, Level *l, uint64_t line, int dirty)
+{
+  uint64_t victim;
+  int victimDirty;
+
+  if (LevelInstall(l, line, dirty, &victim, &victimDirty))
+    HierEvict(h, l, victim, victimDirty);
+}
+
+// Hands a line evicted from a level to the levels below it
+static void HierEvict(Hier *h, Level *from, uint64_t line, int dirty)
+{
+  Level *below;
+  int k, was, way;
+
+  // An inclusive level takes its copies above down with it
+  if (from->inclusion == INCLUSIVE && from->depth > 0)
+  {
+    for (k = 0; k < MAX_LEVELS; ++k)
+    {
+      if (!h->levels[k].present || h->levels[k].depth >= from->depth)
+        continue;
+      was = LevelInvalidate(&h->levels[k], line);
+      if (was >= 0)
+      {
+        ++from->backInvalidations;
+        dirty |= was;
+      }
+    }
+  }
+  if (dirty)
+    ++from->writebacks;
+
+  // An exclusive level takes every victim. Otherwise a clean victim is
+  // dropped and a dirty one updates the first level below that holds it,
+  // or memory
+  for (k = from->depth + 1; k < h->depths; ++k)
+  {
+    below = LevelAt(h, k);
+    if (below->inclusion == EXCLUSIVE)
+    {
+      way = LevelFind(below, line);
+      if (way < 0)
+        HierFill(h, below, line, dirty);
+      else if (dirty)
+        LevelMarkDirty(below, line, way);
+      return;
+    }
+    if (!dirty)
+      return;
+    way = LevelFind(below, line);
+    if (way >= 0)
+    {
+      LevelMarkDirty(below, line, way);
+      return;
+    }
+  }
+  if (dirty)
+    ++h->memoryWrites;
+}
+
+// Fetches line from depth and below for the level above. Returns the
+// latency and sets *dirty if the line comes up dirty from an exclusive
+// level
+static long HierFetch(Hier *h, int depth, uint64_t line, int *dirty)
+{
+  Level *l;
+  long latency;
+  int way;
+
+  *dirty = 0;
+  if (depth == h->depths)
+  {
+    ++h->memoryReads;
+    return h->memoryLatency;
+  }
+
+  l = LevelAt(h, depth);
+  latency = l->latency;
+  ++l->accesses;
+  way = LevelFind(l, line);
+  if (way >= 0)
+  {
+    ++l->hits;
+    if (l->inclusion == EXCLUSIVE)
+      *dirty = LevelInvalidate(l, line);
+    return latency;
+  }
+
+  ++l->misses;
+  latency += HierFetch(h, depth + 1, line, dirty);
+  if (l->inclusion != EXCLUSIVE)
+  {
+    HierFill(h, l, line, *dirty);
+    *dirty = 0;
+  }
+  return latency;
+}
+
+// Runs one reference through the hierarchy. Returns its latency
+static long HierAccess(Hier *h, MemRef *m, int bits)
+{
+  Level *l1 = &h->levels[(*m).access == 'I' ? 0 : 1];
+  uint64_t line = (*m).address >> bits;
+  long latency = l1->latency;
+  int way, dirty;
+
+  ++l1->accesses;
+  way = LevelFind(l1, line);
+  if (way >= 0)
+  {
+    ++l1->hits;
+    if ((*m).access == 'W')
+      LevelMarkDirty(l1, line, way);
+    return latency;
+  }
+
+  ++l1->misses;
+  latency += HierFetch(h, 1, line, &dirty);
+  HierFill(h, l1, line, dirty || (*m).access == 'W');
+  return latency;
+}
+
+static void ReadHierarchy(Hier *h, const char *path)
+{
+  static const char *names[MAX_LEVELS] = { "l1i", "l1d", "l2", "l3" };
+  FILE *f = fopen(path, "r");
+  char line[256], name[16], policy[16], inclusion[16];
+  int lineNo = 0, lineSize = 0, k, fields;
+
+  if (!f)
+  {
+    fprintf(stderr, "Error: Could not open hierarchy file %s\n", path);
+    exit(1);
+  }
+  memset(h, 0, sizeof(*h));
+  h->memoryLatency = -1;
+  for (k = 0; k < MAX_LEVELS; ++k)
+  {
+    h->levels[k].name = names[k];
+    h->levels[k].depth = k < 2 ? 0 : k - 1;
+  }
+
+  while (fgets(line, sizeof(line), f))
+  {
+    Level *l = NULL;
+    Cache *c;
+    int latency;
+
+    ++lineNo;
+    line[strcspn(line, "#")] = '\0';
+    strcpy(policy, "lru");
+    strcpy(inclusion, "nine");
+    fields = sscanf(line, "%15s", name);
+    if (fields <= 0)
+      continue;
+    if (strcmp(name, "memory") == 0)
+    {
+      if (sscanf(line, "%*s %d", &h->memoryLatency) != 1 || h->memoryLatency < 0)
+      {
+        fprintf(stderr, "Error: Bad memory latency on line %d of %s\n", lineNo, path);
+        exit(1);
+      }
+      continue;
+    }
+    for (k = 0; k < MAX_LEVELS; ++k)
+      if (strcmp(name, names[k]) == 0)
+        l = &h->levels[k];
+    if (!l)
+    {
+      fprintf(stderr, "Error: Unknown level %s on line %d of %s\n", name, lineNo, path);
+      exit(1);
+    }
+
+    c = &l->cache;
+    fields = sscanf(line, "%*s %d %d %d %d %15s %15s", &c->numSets, &c->setSize, &c->lineSize,
+                    &latency, policy, inclusion);
+    c->policy = ParsePolicy(policy);
+    c->writePolicy = WRITE_BACK;
+    for (l->inclusion = 0; l->inclusion < NUM_INCLUSIONS; ++l->inclusion)
+      if (strcmp(inclusion, inclusionNames[l->inclusion]) == 0)
+        break;
+    if (fields < 4 || !IsPowerOfTwo(c->numSets) || c->setSize < 1 || !IsPowerOfTwo(c->lineSize) ||
+        latency < 0 || c->policy < 0 || c->policy == OPT || l->inclusion == NUM_INCLUSIONS ||
+        (l->depth == 0 && fields > 6) ||
+        (c->policy == PLRU && (!IsPowerOfTwo(c->setSize) || c->setSize > 64)))
+    {
+      fprintf(stderr, "Error: Bad level on line %d of %s\n", lineNo, path);
+      exit(1);
+    }
+    if (lineSize && c->lineSize != lineSize)
+    {
+      fprintf(stderr, "Error: Every level needs the same line size (line %d of %s)\n", lineNo, path);
+      exit(1);
+    }
+    lineSize = c->lineSize;
+    l->latency = latency;
+    l->present = 1;
+  }
+  fclose(f);
+
+  if (!h->levels[0].present || !h->levels[1].present || !h->levels[2].present || h->memoryLatency < 0)
+  {
+    fprintf(stderr, "Error: %s needs l1i, l1d, l2 and memory lines\n", path);
+    exit(1);
+  }
+  h->depths = h->levels[3].present ? 3 : 2;
+  for (k = 0; k < MAX_LEVELS; ++k)
+    if (h->levels[k].present)
+      Initialize(&h->levels[k].cache);
+}
+
+void Hierarchy(Trace *in, const char *path)
+{
+  Hier h;
+  MemRef ref;
+  long n = 0, fetches = 0, writes = 0, cycles = 0;
+  int bits, k, i = 1;
+
+  ReadHierarchy(&h, path);
+  bits = (int)((log(h.levels[0].cache.lineSize) / log(2)));
+
+  while (ReadRef(in, &ref, i++))
+  {
+    ++n;
+    if (ref.access == 'I')
+      ++fetches;
+    else if (ref.access == 'W')
+      ++writes;
+    cycles += HierAccess(&h, &ref, bits);
+  }
+
+  printf("Cache Hierarchy Simulation\n\n");
+  printf("   %ld references: %ld instruction fetches, %ld reads, %ld writes\n", n, fetches, n - fetches - writes, writes);
+  printf("   write-back, line size %d bytes\n\n\n", h.levels[0].cache.lineSize);
+  printf("Level   Sets Ways Latency Policy Inclusion\n");
+  printf("----- ------ ---- ------- ------ ---------\n");
+  for (k = 0; k < MAX_LEVELS; ++k)
+  {
+    Level *l = &h.levels[k];
+    if (l->present)
+      printf("%-5s %6d %4d %7d %6s %9s\n", l->name, l->cache.numSets, l->cache.setSize, l->latency,
+             policyNames[l->cache.policy], l->depth ? inclusionNames[l->inclusion] : "-");
+  }
+  printf("memory               %7d\n\n\n", h.memoryLatency);
+
+  printf("Level   Accesses       Hits     Misses Miss Ratio Writebacks Back-Invalidations\n");
+  printf("----- ---------- ---------- ---------- ---------- ---------- ------------------\n");
+  for (k = 0; k < MAX_LEVELS; ++k)
+  {
+    Level *l = &h.levels[k];
+    if (!l->present)
+      continue;
+    printf("%-5s %10ld %10ld %10ld %10f %10ld %18ld\n", l->name, l->accesses, l->hits, l->misses,
+           l->accesses ? (double)l->misses / l->accesses : 0.0, l->writebacks, l->backInvalidations);
+    Release(&l->cache);
+  }
+  printf("\n\nMemory Reads: %ld\n", h.memoryReads);
+  printf("Memory Writes: %ld\n", h.memoryWrites);
+  printf("AMAT: %f cycles\n\n", n ? (double)cycles / n : 0.0);
+}
+
+//////////////////////////////
+// Set-Partitioned Simulation
+//
+// A reference only ever touches the one set Calculate maps it to, so a
+// single cache can be split across threads by set. Each worker owns a
+// contiguous range of sets; the main thread parses the trace and hands
+// every reference to its set's owner through a lock-free
+// single-producer/single-consumer ring. Every set still sees its
+// references in trace order, and statistics are kept per set and summed
+// at the end, so the totals match a serial run exactly. DIP is rejected
+// because its selector is shared by all sets.
+//////////////////////////////
+
+typedef struct{
+  MemRef slots[RING_SIZE];
+  _Alignas(64) atomic_size_t head;   // next slot to read
+  _Alignas(64) atomic_size_t tail;   // next slot to write
+  _Alignas(64) atomic_int done;
+} RefRing;
+
+static void RingInit(RefRing *ring)
+{
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->done, 0);
+}
+
+static void RingPush(RefRing *ring, const MemRef *ref)
+{
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_SIZE)
+    sched_yield();
+  ring->slots[tail & (RING_SIZE - 1)] = *ref;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// Returns 0 once the ring is empty and the producer has finished
+static int RingPop(RefRing *ring, MemRef *ref)
+{
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  while (head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+  {
+    if (atomic_load_explicit(&ring->done, memory_order_acquire) &&
+        head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+      return 0;
+    sched_yield();
+  }
+  *ref = ring->slots[head & (RING_SIZE - 1)];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return 1;
+}
+
+typedef struct{
+  Cache *cache;
+  RefRing ring;
+  long *setHits, *setMisses, *setMemrefs;
+} PartitionWorker;
+
+static void *PartitionRun(void *arg)
+{
+  PartitionWorker *w = (PartitionWorker*) arg;
+  MemRef ref;
+  Trans t;
+  Block b;
+
+  while (RingPop(&w->ring, &ref))
+  {
+    if (Access(w->cache, &ref, &t, &b))
+      ++w->setHits[t.index];
+    else
+      ++w->setMisses[t.index];
+    w->setMemrefs[t.index] += t.memref;
+  }
+  return NULL;
+}
+
+void Partition(Trace *in, Cache *c, int threads)
+{
+  int bits = (int)((log(c->lineSize) / log(2)));
+  long *setHits, *setMisses, *setMemrefs, hits = 0, misses = 0, memrefs = 0;
+  int i = 1, k;
+  MemRef ref;
+
+  if (c->policy == DIP)
+  {
+    fprintf(stderr, "Error: dip shares state across sets and cannot be partitioned\n");
+    exit(1);
+  }
+  if (threads > c->numSets)
+    threads = c->numSets;
+
+  Initialize(c);
+  // Workers share the tag array, so it cannot be widened mid-run
+  WidenTags(c);
+  setHits = (long*) calloc(c->numSets, sizeof(long));
+  setMisses = (long*) calloc(c->numSets, sizeof(long));
+  setMemrefs = (long*) calloc(c->numSets, sizeof(long));
+  PartitionWorker *workers = (PartitionWorker*) aligned_alloc(64,
+    ((threads * sizeof(PartitionWorker) + 63) / 64) * 64);
+  pthread_t *ids = (pthread_t*) malloc(threads * sizeof(pthread_t));
+  if (!setHits || !setMisses || !setMemrefs || !workers || !ids)
+  {
+    fprintf(stderr, "Error: Out of memory for %d workers\n", threads);
+    exit(1);
+  }
+
+  for (k = 0; k < threads; ++k)
+  {
+    workers[k].cache = c;
+    workers[k].setHits = setHits;
+    workers[k].setMisses = setMisses;
+    workers[k].setMemrefs = setMemrefs;
+    RingInit(&workers[k].ring);
+    if (pthread_create(&ids[k], NULL, PartitionRun, &workers[k]) != 0)
+    {
+      fprintf(stderr, "Error: Could not start worker thread\n");
+      exit(1);
+    }
+  }
+
+  while (ReadRef(in, &ref, i++))
+  {
+    long set = (long)((ref.address >> bits) % c->numSets);
+    RingPush(&workers[set * threads / c->numSets].ring, &ref);
+  }
+
+  for (k = 0; k < threads; ++k)
+  {
+    atomic_store_explicit(&workers[k].ring.done, 1, memory_order_release);
+    pthread_join(ids[k], NULL);
+  }
+
+  for (k = 0; k < c->numSets; ++k)
+  {
+    hits += setHits[k];
+    misses += setMisses[k];
+    memrefs += setMemrefs[k];
+  }
+
+  printf("Set-Partitioned Simulation\n\n");
+  printf("   %d %d-way set associative entries\n", c->numSets, c->setSize);
+  printf("   with %s replacement on %d threads\n", policyNames[c->policy], threads);
+  printf("\n\nCache Statistics:\n");
+  printf("Total Hits: %ld\n", hits);
+  printf("Total Misses: %ld\n", misses);
+  printf("Total Accesses: %ld\n", hits + misses);
+  printf("Total Memrefs: %ld\n", memrefs);
+  printf("Hit Ratio: %f\n", hits + misses ? (float)hits / (hits + misses) : 0.0);
+  printf("Miss ratio: %f\n\n", hits + misses ? (float)misses / (hits + misses) : 0.0);
+
+  Release(c);
+  free(ids);
+  free(workers);
+  free(setHits);
+  free(setMisses);
+  free(setMemrefs);
+}
+
+//////////////////////////////
+// Pipelined Simulation
+//
+// Produces the same output as the default mode, but the trace is parsed
+// on a second thread so reading and decoding overlap with simulation.
+// The parser collects RING_BATCH references before publishing them, and
+// the simulator drains everything available at once, so the shared ring
+// indices are touched once per batch rather than once per reference.
+//////////////////////////////
+
+static void RingPushBatch(RefRing *ring, const MemRef *refs, size_t n)
+{
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed), k;
+  while (tail + n - atomic_load_explicit(&ring->head, memory_order_acquire) > RING_SIZE)
+    sched_yield();
+  for (k = 0; k < n; ++k)
+    ring->slots[(tail + k) & (RING_SIZE - 1)] = refs[k];
+  atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+}
+
+// Copies out up to max references. Returns 0 once the ring is empty and
+// the producer has finished
+static size_t RingPopBatch(RefRing *ring, MemRef *refs, size_t max)
+{
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed), tail, n, k;
+  while ((tail = atomic_load_explicit(&ring->tail, memory_order_acquire)) == head)
+  {
+    if (atomic_load_explicit(&ring->done, memory_order_acquire) &&
+        head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+      return 0;
+    sched_yield();
+  }
+  n = tail - head < max ? tail - head : max;
+  for (k = 0; k < n; ++k)
+    refs[k] = ring->slots[(head + k) & (RING_SIZE - 1)];
+  atomic_store_explicit(&ring->head, head + n, memory_order_release);
+  return n;
+}
+
+typedef struct{
+  Trace *in;
+  RefRing ring;
+  atomic_int stop;     // set when the simulator needs no more references
+} PipelineParser;
+
+static void *PipelineParse(void *arg)
+{
+  PipelineParser *p = (PipelineParser*) arg;
+  MemRef batch[RING_BATCH];
+  size_t n = 0;
+  int i = 1;
+
+  while (!atomic_load_explicit(&p->stop, memory_order_relaxed) &&
+         ReadRef(p->in, &batch[n], i++))
+  {
+    if (++n == RING_BATCH)
+    {
+      RingPushBatch(&p->ring, batch, n);
+      n = 0;
+    }
+  }
+  if (n)
+    RingPushBatch(&p->ring, batch, n);
+  atomic_store_explicit(&p->ring.done, 1, memory_order_release);
+  return NULL;
+}
+
+void Pipeline(Trace *in, Cache *c, Report *r, Stats *s)
+{
+  PipelineParser *parser = (PipelineParser*) aligned_alloc(64, sizeof(PipelineParser));
+  MemRef batch[RING_BATCH];
+  pthread_t id;
+  size_t n, k;
+  int i = 1, hits = 0, misses = 0, stopped = 0;
+  long memrefs = 0;
+  Trans t;
+  Block b;
+
+  if (!parser)
+  {
+    fprintf(stderr, "Error: Out of memory for the parse ring\n");
+    exit(1);
+  }
+  parser->in = in;
+  RingInit(&parser->ring);
+  atomic_init(&parser->stop, 0);
+  if (pthread_create(&id, NULL, PipelineParse, parser) != 0)
+  {
+    fprintf(stderr, "Error: Could not start parser thread\n");
+    exit(1);
+  }
+
+  Initialize(c);
+  Layout(c, r);
+  ReportOpen(r);
+  // Once the statistics converge, the rest of what the parser has
+  // already queued is drained without being simulated
+  while ((n = RingPopBatch(&parser->ring, batch, RING_BATCH)) > 0)
+  {
+    for (k = 0; k < n && !stopped; ++k)
+    {
+      if (Access(c, &batch[k], &t, &b))
+        hits++;
+      else
+        misses++;
+
+      PrintData(r, i, &batch[k], &t, &b);
+      memrefs += t.memref;
+      if (i == s->next && Snapshot(s, hits, misses, memrefs))
+      {
+        stopped = 1;
+        atomic_store_explicit(&parser->stop, 1, memory_order_relaxed);
+      }
+      i++;
+    }
+  }
+  pthread_join(id, NULL);
+  ReportClose(r);
+  StatsClose(s, hits, misses, memrefs);
+
+  PrintCache(hits, misses);
+  Release(c);
+  free(parser);
+}
+
+//////////////////////////////
+// Report Output
+//
+// Formatting the per-reference table with printf costs far more than
+// simulating the reference, so rows are formatted by hand into
+// REPORT_BUFFER-sized buffers and written a buffer at a time. Everything
+// goes through stdout's FILE, so the rows stay in order with the printf
+// output before and after them.
+//////////////////////////////
+
+static void ReportWrite(const char *buffer, size_t length)
+{
+  if (fwrite(buffer, 1, length, stdout) != length)
+  {
+    fprintf(stderr, "Error: Could not write the report\n");
+    exit(1);
+  }
+}
+
+static void *ReportWriter(void *arg)
+{
+  Report *r = (Report*) arg;
+
+  pthread_mutex_lock(&r->lock);
+  for (;;)
+  {
+    while (!r->pending && !r->done)
+      pthread_cond_wait(&r->changed, &r->lock);
+    if (!r->pending)
+      break;
+    pthread_mutex_unlock(&r->lock);
+    ReportWrite(r->pending, r->pendingLength);
+    pthread_mutex_lock(&r->lock);
+    r->pending = NULL;
+    pthread_cond_broadcast(&r->changed);
+  }
+  pthread_mutex_unlock(&r->lock);
+  return NULL;
+}
+
+// Writes out the buffer being formatted into, or hands it to the writer
+// thread once the one before it has been written
+static void ReportFlush(Report *r)
+{
+  if (!r->background)
+  {
+    ReportWrite(r->buffer[r->active], r->length);
+    r->length = 0;
+    return;
+  }
+  pthread_mutex_lock(&r->lock);
+  while (r->pending)
+    pthread_cond_wait(&r->changed, &r->lock);
+  r->pending = r->buffer[r->active];
+  r->pendingLength = r->length;
+  pthread_cond_broadcast(&r->changed);
+  pthread_mutex_unlock(&r->lock);
+  r->active ^= 1;
+  r->length = 0;
+}
+
+void ReportOpen(Report *r)
+{
+  if (r->verbosity == VERBOSE_SUMMARY)
+    return;
+  r->buffer[0] = (char*) malloc(REPORT_BUFFER);
+  r->buffer[1] = r->background ? (char*) malloc(REPORT_BUFFER) : NULL;
+  if (!r->buffer[0] || (r->background && !r->buffer[1]))
+  {
+    fprintf(stderr, "Error: Out of memory for the report\n");
+    exit(1);
+  }
+  r->active = 0;
+  r->length = 0;
+  if (r->background)
+  {
+    r->pending = NULL;
+    r->done = 0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->changed, NULL);
+    if (pthread_create(&r->writer, NULL, ReportWriter, r) != 0)
+    {
+      fprintf(stderr, "Error: Could not start report writer thread\n");
+      exit(1);
+    }
+  }
+}
+
+void ReportClose(Report *r)
+{
+  if (r->verbosity == VERBOSE_SUMMARY)
+    return;
+  if (r->length)
+    ReportFlush(r);
+  if (r->background)
+  {
+    pthread_mutex_lock(&r->lock);
+    r->done = 1;
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->writer, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->changed);
+  }
+  free(r->buffer[0]);
+  free(r->buffer[1]);
+}
+
+// Right-justifies value in at least width characters, like %*d or %*x
+static char *FormatNumber(char *out, uint64_t value, int hex, int width)
+{
+  char digits[20];
+  int n = 0;
+
+  do
+  {
+    if (hex)
+    {
+      digits[n++] = "0123456789abcdef"[value & 0xf];
+      value >>= 4;
+    }
+    else
+    {
+      digits[n++] = (char)('0' + value % 10);
+      value /= 10;
+    }
+  } while (value);
+  while (width-- > n)
+    *out++ = ' ';
+  while (n)
+    *out++ = digits[--n];
+  return out;
+}
+
+// Right-justifies text in width characters, like %*s
+static char *FormatText(char *out, const char *text, int width)
+{
+  int n = (int)strlen(text);
+
+  while (width-- > n)
+    *out++ = ' ';
+  memcpy(out, text, n);
+  return out + n;
+}
+
+void Layout(Cache *c, Report *r)
+{
+  printf("Cache Configuration\n\n");
+  printf("   %d %d-way set associative entries\n", c->numSets, c->setSize);
+  printf("   of line size 8 bytes\n");
+  printf("   with %s replacement\n\n\n", policyNames[c->policy]);
+  if ((*r).verbosity == VERBOSE_SUMMARY)
+    return;
+  printf("Results for Each Reference\n\n");
+  printf("Ref  Access Address    Tag   Index Offset Result Memrefs\n");
+  printf("---- ------ -------- ------- ----- ------ ------ -------\n");
+}
+
+// Formats the row printf("%4d %6s %8x %7u %5d %6d %6s %7d\n") would
+void PrintData(Report *r, int i, MemRef *m, Trans *t, Block *b) 
+{
+  char *out;
+
+  if ((*r).verbosity == VERBOSE_SUMMARY)
+    return;
+  if ((*r).verbosity == VERBOSE_SAMPLE && (i - 1) % (*r).every != 0)
+    return;
+
+  if ((*r).length > REPORT_BUFFER - REPORT_ROW)
+    ReportFlush(r);
+  out = (*r).buffer[(*r).active] + (*r).length;
+  out = FormatNumber(out, (uint64_t)i, 0, 4);
+  *out++ = ' ';
+  out = FormatText(out, ((*m).access == 'W') ? "Write" : "Read", 6);
+  *out++ = ' ';
+  out = FormatNumber(out, (*m).address, 1, 8);
+  *out++ = ' ';
+  out = FormatNumber(out, (*b).tag, 0, 7);
+  *out++ = ' ';
+  out = FormatNumber(out, (uint64_t)(*t).index, 0, 5);
+  *out++ = ' ';
+  out = FormatNumber(out, (uint64_t)(*t).offset, 0, 6);
+  *out++ = ' ';
+  out = FormatText(out, ((*t).result == 0) ? "Miss" : "Hit", 6);
+  *out++ = ' ';
+  out = FormatNumber(out, (uint64_t)(*t).memref, 0, 7);
+  *out++ = '\n';
+  (*r).length = out - (*r).buffer[(*r).active];
+}
+
+//////////////////////////////
+// Interval Statistics
+//
+// Every -n references the running hit, miss and memory reference totals
+// are written out along with the counts for that interval alone, so phase
+// changes show up without waiting for the end of the trace. With -x the
+// run stops once the interval miss ratio has stayed within the tolerance
+// of the running one for CONVERGED_SNAPSHOTS snapshots in a row.
+//////////////////////////////
+
+void StatsOpen(Stats *s, const char *path)
+{
+  size_t n;
+
+  s->out = stderr;
+  s->next = s->period ? s->period : -1;
+  if (!s->period)
+    return;
+  if (path)
+  {
+    s->out = fopen(path, "w");
+    if (!s->out)
+    {
+      fprintf(stderr, "Error: Could not create %s\n", path);
+      exit(1);
+    }
+    n = strlen(path);
+    s->csv = n > 4 && strcmp(path + n - 4, ".csv") == 0;
+  }
+  if (s->csv)
+    fprintf(s->out, "refs,hits,misses,memrefs,miss_ratio,interval_hits,interval_misses,interval_memrefs,interval_miss_ratio\n");
+}
+
+// Returns 1 once the miss ratio has converged
+int Snapshot(Stats *s, long hits, long misses, long memrefs)
+{
+  long refs = hits + misses;
+  long dh = hits - s->hits, dm = misses - s->misses, dr = memrefs - s->memrefs;
+  double ratio = refs ? (double)misses / refs : 0.0;
+  double recent = dh + dm ? (double)dm / (dh + dm) : 0.0;
+
+  if (s->csv)
+    fprintf(s->out, "%ld,%ld,%ld,%ld,%f,%ld,%ld,%ld,%f\n",
+      refs, hits, misses, memrefs, ratio, dh, dm, dr, recent);
+  else
+    fprintf(s->out, "{\"refs\": %ld, \"hits\": %ld, \"misses\": %ld, \"memrefs\": %ld, \"miss_ratio\": %f, "
+      "\"interval_hits\": %ld, \"interval_misses\": %ld, \"interval_memrefs\": %ld, \"interval_miss_ratio\": %f}\n",
+      refs, hits, misses, memrefs, ratio, dh, dm, dr, recent);
+
+  s->last = refs;
+  s->next = refs + s->period;
+  s->hits = hits;
+  s->misses = misses;
+  s->memrefs = memrefs;
+
+  if (s->tolerance >= 0 && fabs(recent - ratio) <= s->tolerance)
+    s->steady++;
+  else
+    s->steady = 0;
+  if (s->steady < CONVERGED_SNAPSHOTS)
+    return 0;
+  fprintf(stderr, "Miss ratio converged after %ld references, stopping\n", refs);
+  return 1;
 }
 
-void PrintData(int i, MemRef *m, Trans *t, Block *b) 
+// Snapshots whatever the last full interval left over
+void StatsClose(Stats *s, long hits, long misses, long memrefs)
 {
-  printf("%4d %6s %8x %7d %5d %6d %6s %7d\n", 
-    i, 
-    ((*m).access == 'W') ? "Write" : "Read", 
-    (*m).address, 
-    (*b).tag, 
-    (*t).index, 
-    (*t).offset, 
-    ((*t).result == 0) ? "Miss" : "Hit",
-    (*t).memref
-    );
+  if (!s->period)
+    return;
+  s->tolerance = -1;
+  if (hits + misses > s->last)
+    Snapshot(s, hits, misses, memrefs);
+  if (s->out != stderr && fclose(s->out) != 0)
+    fprintf(stderr, "Error: Could not write the statistics\n");
 }
 
 void PrintCache(int hits, int misses) 
@@ -1,9 +1,13 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "cachesim.h"
+#include "../trace/trace.h"
 
 const int LINESIZE = 4;     // line size in bytes, must be power of 2, min=4 !!
 const int SIZE     = 8192;  // total capacity in bytes, must be power of 2
 const int WB_DEPTH = 1;     // depth of Wr buffer, 0 means none
+const int COMPUTE_GAP = 1;  // cycles between references, overridden by argv[1]
 
 // You shouldn't need to change any of the below constants
 
@@ -31,69 +35,166 @@ const int RM_PENALTY         = SEND_LINES + DRAM_LATENCY + SEND_WORD +
                                ((WPLINE-1) * (DRAM_LATENCY_NEXT+SEND_WORD));
 const int WM_PENALTY         = SEND_LINES + DRAM_LATENCY + SEND_WORD;
 
+// ------------------------------------------------------------------------
+// The Clock is a global cycle counter plus a queue of the memory
+// transactions in flight, soonest first.  Nothing happens between
+// events, so the clock jumps from one to the next.
+// ------------------------------------------------------------------------
+
+void 
+Clock::schedule(int delay, int kind, uint64_t addr) 
+{
+  Event e;
+  e.time = now + delay;
+  e.kind = kind;
+  e.addr = addr;
+  events.push(e);
+}
+
+Event 
+Clock::next() 
+{
+  Event e = events.top();
+  events.pop();
+  skipTo(e.time);
+  return e;
+}
+
 // ------------------------------------------------------------------------
 // Below is the code for implementing write buffers.  You shouldn't
 // need to study it unless you're doing extra credit. 
+// The buffer is a FIFO of addresses.  The front one is on the bus while
+// writing is set, and finishes with a WRITE_DONE event.  A read sets
+// held while it owns the bus, and its READ_DONE event lets the buffer
+// drain again.
 // ------------------------------------------------------------------------
 
-int 
-WriteBuffer::relinquishBus() 
+WriteBuffer::WriteBuffer(int size, int cyclesPerItem, Clock& c) :
+  clock(c)
 {
-  if (maxCycles == 0)  // no write buffer
-    return 0;
-  else {
-    int temp = cyclesUntilEmpty % memLatency;
-    cyclesUntilEmpty -= temp;
-    return temp;
+  printf ("wb size = %d\n", size);
+  memLatency = cyclesPerItem;
+  maxItems = size;
+  writing = held = 0;
+  busyCycles = rawStallCycles = busStallCycles = writeStallCycles = 0;
+}
+
+void 
+WriteBuffer::startNext() 
+{
+  if (!writing && !held && !items.empty()) {
+    writing = 1;
+    busyCycles += memLatency;
+    clock.schedule(memLatency, WRITE_DONE, items.front());
   }
 }
 
+void 
+WriteBuffer::dispatch(const Event& e) 
+{
+  if (e.kind == WRITE_DONE) {
+    items.pop_front();
+    writing = 0;
+  }
+  else
+    held = 0;
+  startNext();
+}
+
 int 
-WriteBuffer::addItem(int addr)  // addr is currently not used 
+WriteBuffer::holds(uint64_t addr, int lineSize) 
+{
+  for (size_t i = 0; i < items.size(); i++)
+    if (items[i] / lineSize == addr / lineSize)
+      return 1;
+  return 0;
+}
+
+long long 
+WriteBuffer::relinquishBus() 
+{
+  long long start = clock.time();
+  held = 1;
+  while (writing)
+    dispatch(clock.next());
+  return clock.time() - start;
+}
+
+long long 
+WriteBuffer::addItem(uint64_t addr) 
 {
-  if (maxCycles == 0) // no write buffer
+  long long start = clock.time();
+  if (maxItems == 0) {  // no write buffer
+    busyCycles += memLatency;
+    writeStallCycles += memLatency;
+    clock.skipTo(start + memLatency);
     return memLatency;  // always pay the full penalty
-  else {
-    int cycles = 0;
-    if (isFull())
-      cycles = relinquishBus();
-    cyclesUntilEmpty += memLatency;
-    return cycles;
   }
+  while (isFull())
+    dispatch(clock.next());
+  items.push_back(addr);
+  startNext();
+  writeStallCycles += clock.time() - start;
+  return clock.time() - start;
+}
+
+long long 
+WriteBuffer::readLine(uint64_t addr, int lineSize, int penalty) 
+{
+  long long start = clock.time();
+  while (holds(addr, lineSize))  // read after write: let it reach memory
+    dispatch(clock.next());
+  rawStallCycles += clock.time() - start;
+  busStallCycles += relinquishBus();
+  busyCycles += penalty;
+  clock.schedule(penalty, READ_DONE, addr);
+  while (held)
+    dispatch(clock.next());
+  return clock.time() - start;
 }
 
 int 
-WriteBuffer::advanceCycles(int cycles) 
+WriteBuffer::advanceCycles(long long cycles) 
 { 
-  if (maxCycles > 0) {
-    int temp = cyclesUntilEmpty;
-    if (cyclesUntilEmpty < cycles)
-      cyclesUntilEmpty = 0;
-    else {
-      cyclesUntilEmpty = cyclesUntilEmpty - cycles;
-      temp = cycles;
-    }
-    return temp;  // how many cycles did we actually consume?
+  long long until = clock.time() + cycles;
+  int written = 0;
+  while (clock.pending() && clock.nextTime() <= until) {
+    Event e = clock.next();
+    written += (e.kind == WRITE_DONE);
+    dispatch(e);
   }
-  return 0;
+  clock.skipTo(until);
+  return written;
 }
 
-WriteBuffer::WriteBuffer(int size, int cyclesPerItem) 
+void 
+WriteBuffer::report(ostream& os) 
 {
-  printf ("wb size = %d\n", size);
-  memLatency = cyclesPerItem;
-  cyclesUntilEmpty = 0;
-  maxCycles = size * memLatency;
+  long long cycles = clock.time();
+  os << "Cycles = " << cycles << ", bus busy = " << busyCycles << " ("
+     << (cycles ? (float)busyCycles / cycles * 100.0 : 0.0) << "%)" << endl;
+  os << "Read stalls: waiting on buffered writes = " << rawStallCycles
+     << ", waiting for the bus = " << busStallCycles << endl;
+  os << "Write stalls: waiting on the write buffer = " << writeStallCycles << endl;
+}
+
+void 
+WriteBuffer::sample(long long* stats) 
+{
+  stats[BUS_BUSY] = busyCycles;
+  stats[RAW_STALLS] = rawStallCycles;
+  stats[BUS_STALLS] = busStallCycles;
+  stats[WB_STALLS] = writeStallCycles;
 }
   
 // ------------------------------------------------------------------------
 // Below are two important global functions which, given an address,
-// return the cache index or tag.
-// You need to fill in the details for these two functions:
+// return the cache index or tag.  The cache is direct mapped, so the
+// line number picks the block and the bits above it are the tag.
 // ------------------------------------------------------------------------
 
-int INDEX(int addr) { return 0; }
-int TAG(int addr) { return 0; }
+int INDEX(uint64_t addr) { return (int)(addr / LINESIZE % LINES); }
+uint64_t TAG(uint64_t addr) { return addr / LINESIZE / LINES; }
 
 // ------------------------------------------------------------------------
 // Below is the implementation of CacheBlock's methods.
@@ -107,26 +208,23 @@ CacheBlock::CacheBlock()
 
 // ------------------------------------------------------------------------
 // For a WriteThrough cache:
-//  Readhits:  we can provide the data directly, so no stall occurs,
-//     and we give the writebuffer one cycle.
+//  Readhits:  we can provide the data directly, so no stall occurs.
+//     The writebuffer drains between references, in main.
 //  Readmisses: we need to fetch the data from memory.  This means first
-//     contending for the bus with the writebuffer, and then actually 
-//     fetching the data from memory, setting the line to valid, and updating
-//     the tag.
-// Currently implements no write-buffer.  You need to add the right lines
-// of code to use the write-buffer.  Later, you'll modify this method to
-// implement a write-back policy.
+//     waiting for any buffered write to the same line, contending for the
+//     bus with the writebuffer, and then actually fetching the data from
+//     memory, setting the line to valid, and updating the tag.
 // ------------------------------------------------------------------------
 
 int 
-CacheBlock::read(int addr, WriteBuffer& writeBuffer, int& cycles) 
+CacheBlock::read(uint64_t addr, WriteBuffer& writeBuffer, long long& cycles) 
 {
   if (valid && tag == TAG(addr)) {  // read hit
     cycles = 0;  // don't stall on a read hit
     return 1;
   }
   else {         // read miss
-    cycles = RM_PENALTY;   // now fetch item from memory
+    cycles = writeBuffer.readLine(addr, LINESIZE, RM_PENALTY);
     valid = 1;
     tag = TAG(addr);
     return 0;
@@ -140,16 +238,13 @@ CacheBlock::read(int addr, WriteBuffer& writeBuffer, int& cycles)
 //  WriteMisses: since we're modeling a the writearound policy, we don't
 //     make any changes to the cache, but just write to the next level
 //     of our hierarchy, which again means giving the word to the writebuffer.
-// Currently implements no write-buffer.  You need to add the right lines
-// of code to use the write-buffer.  Later, you'll modify this method to
-// implement a write-back policy.
 // ------------------------------------------------------------------------
 
 int 
-CacheBlock::write(int addr, WriteBuffer& writeBuffer, int& cycles) 
+CacheBlock::write(uint64_t addr, WriteBuffer& writeBuffer, long long& cycles) 
 {
   // With WT, on a hit or miss, we always write around to memory...
-  cycles = WM_PENALTY;
+  cycles = writeBuffer.addItem(addr);
   return (valid && tag == TAG(addr));  // was it a hit?
 }
 
@@ -174,9 +269,9 @@ Cache::Cache(int lines, int blockSizeInBytes, WriteBuffer& wb) :
 // ------------------------------------------------------------------------
 
 int 
-Cache::read(int addr) 
+Cache::read(uint64_t addr) 
 {
-  int cycles = 0;
+  long long cycles = 0;
   int hit = 0;
   hit = blocks[INDEX(addr)].read(addr, writeBuffer, cycles);
   updateStats(hit, cycles, readHits, readMisses, readStallCycles);
@@ -188,9 +283,9 @@ Cache::read(int addr)
 // ------------------------------------------------------------------------
 
 int 
-Cache::write(int addr) 
+Cache::write(uint64_t addr) 
 {
-  int cycles = 0;
+  long long cycles = 0;
   int hit = 0;
   hit = blocks[INDEX(addr)].write(addr, writeBuffer, cycles);
   updateStats(hit, cycles, writeHits, writeMisses, writeStallCycles);
@@ -198,7 +293,7 @@ Cache::write(int addr)
 }
 
 void 
-Cache::updateStats(int hit, int cycles, int& hits, int& misses, int& cycleCt) 
+Cache::updateStats(int hit, long long cycles, int& hits, int& misses, long long& cycleCt) 
 {
   if (hit)
     hits++;
@@ -212,7 +307,7 @@ Cache::report(ostream& os) {
   int totalHits = readHits + writeHits;
   int totalMisses = readMisses + writeMisses;
   int totalRefs = totalHits + totalMisses;
-  int cycles = readStallCycles + writeStallCycles;
+  long long cycles = readStallCycles + writeStallCycles;
   os << "# Lines = " << numBlocks << " linesize = " << blockSize 
      << " bytes"<< endl;
   os << "Reads:  hits = " << readHits << ", misses = " << readMisses << endl;
@@ -223,40 +318,232 @@ Cache::report(ostream& os) {
   os << "Total accesses = " << totalRefs << endl;
 }
 
+void 
+Cache::sample(long long* stats) 
+{
+  stats[READ_HITS] = readHits;
+  stats[READ_MISSES] = readMisses;
+  stats[WRITE_HITS] = writeHits;
+  stats[WRITE_MISSES] = writeMisses;
+  stats[READ_STALLS] = readStallCycles;
+  stats[WRITE_STALLS] = writeStallCycles;
+}
+
+// ------------------------------------------------------------------------
+// Snapshots.  A row is due after every refPeriod references, or after
+// the first reference that ends at or past the next multiple of
+// cyclePeriod.  Time can jump several periods in one reference (a
+// long stall, or a gap in a timestamped trace), and then one row
+// covers them all.  The rows match the ones ./sim -s writes, with
+// cycle and stall counters in place of the memory reads and writes.
+// ------------------------------------------------------------------------
+
+const char* STAT_NAMES[NUM_STATS] = {
+  "read_hits", "read_misses", "write_hits", "write_misses",
+  "read_stall_cycles", "write_stall_cycles", "bus_busy_cycles",
+  "raw_stall_cycles", "bus_stall_cycles", "wb_stall_cycles"
+};
+
+Snapshots::Snapshots(FILE* o, int c, long rp, long long cp,
+                     Cache& ca, WriteBuffer& wb, Clock& cl) :
+  cache(ca), writeBuffer(wb), clock(cl)
+{
+  out = o;
+  csv = c;
+  refPeriod = rp;
+  cyclePeriod = cp;
+  nextCycle = cp;
+  refs = lastRefs = 0;
+  memset(last, 0, sizeof(last));
+  if (csv && out != NULL) {
+    fprintf(out, "refs,cycles");
+    for (int i = 0; i < NUM_STATS; i++)
+      fprintf(out, ",%s", STAT_NAMES[i]);
+    fprintf(out, ",miss_ratio");
+    for (int i = 0; i < NUM_STATS; i++)
+      fprintf(out, ",interval_%s", STAT_NAMES[i]);
+    fprintf(out, ",interval_miss_ratio\n");
+  }
+}
+
+void 
+Snapshots::reference() 
+{
+  refs++;
+  if (out == NULL)
+    return;
+  if (refPeriod > 0 && refs % refPeriod == 0)
+    take();
+  else if (cyclePeriod > 0 && clock.time() >= nextCycle)
+    take();
+}
+
+void 
+Snapshots::finish() 
+{
+  if (out != NULL && refs > lastRefs)
+    take();
+}
+
+void 
+Snapshots::take() 
+{
+  long long now[NUM_STATS], delta[NUM_STATS];
+  double ratio, recent;
+  int i;
+
+  cache.sample(now);
+  writeBuffer.sample(now);
+  for (i = 0; i < NUM_STATS; i++)
+    delta[i] = now[i] - last[i];
+  ratio = (double)(now[READ_MISSES] + now[WRITE_MISSES]) / refs;
+  recent = (double)(delta[READ_MISSES] + delta[WRITE_MISSES]) / (refs - lastRefs);
+
+  if (csv) {
+    fprintf(out, "%ld,%lld", refs, clock.time());
+    for (i = 0; i < NUM_STATS; i++)
+      fprintf(out, ",%lld", now[i]);
+    fprintf(out, ",%f", ratio);
+    for (i = 0; i < NUM_STATS; i++)
+      fprintf(out, ",%lld", delta[i]);
+    fprintf(out, ",%f\n", recent);
+  }
+  else {
+    fprintf(out, "{\"refs\": %ld, \"cycles\": %lld", refs, clock.time());
+    for (i = 0; i < NUM_STATS; i++)
+      fprintf(out, ", \"%s\": %lld", STAT_NAMES[i], now[i]);
+    fprintf(out, ", \"miss_ratio\": %f", ratio);
+    for (i = 0; i < NUM_STATS; i++)
+      fprintf(out, ", \"interval_%s\": %lld", STAT_NAMES[i], delta[i]);
+    fprintf(out, ", \"interval_miss_ratio\": %f}\n", recent);
+  }
+
+  memcpy(last, now, sizeof(last));
+  lastRefs = refs;
+  while (cyclePeriod > 0 && nextCycle <= clock.time())
+    nextCycle += cyclePeriod;
+}
+
 // ------------------------------------------------------------------------
 // Main.
-// The format of the data file is <type> <addr> ... <type> <addr> <eof>
-// <type> is a decimal, where 0 means instruction fetch, 1 means data load
-// and 2 means data store.  <addr> is a hex address that is being accessed.
-// Main just reads <type> <addr> pairs from standard input, dispatching
-// the accesses to the cache.
-// When an <eof> is encountered, the loop is exited and the cache stats are
-// reported.
+// The trace on standard input goes through the shared trace reader (see
+// ../trace/trace.h), so it may be in any text dialect or binary, and
+// gzip or zstd compressed.  The dialect is guessed from the first line
+// unless argv[2] names it.  In the cachesim dialect each line is
+// <type> <addr> [<cycle>]: <type> is a decimal, where 0 means
+// instruction fetch, 1 means data load and 2 means data store, and
+// <addr> is a hex address that is being accessed.
+// <cycle>, if given, is the decimal cycle the reference is issued at.
+// Otherwise it is issued COMPUTE_GAP cycles (or argv[1]) after the last
+// one finished, and the write buffer drains in between.
+// Main dispatches the accesses to the cache until the trace runs out,
+// then reports the cache stats.
+// Options come before the gap: -s <refs> or -c <cycles> writes a
+// snapshot of the counters every <refs> references or <cycles> cycles
+// to -o <stats file> (default stdout), as JSON lines or CSV for a .csv
+// file.
 // ------------------------------------------------------------------------
 
-void main () 
+const int TRACE_BATCH = 1024;  // references read from the trace at once
+
+int main (int argc, char** argv) 
 {
-  WriteBuffer wb(WB_DEPTH, WM_PENALTY);
+  Clock clock;
+  WriteBuffer wb(WB_DEPTH, WM_PENALTY, clock);
   Cache cache(LINES, LINESIZE, wb);
-  int i, iloads, type, addr, hit;
+  TraceRef refs[TRACE_BATCH];
+  TraceInput input;
+  FILE *in, *stats;
+  const char* statsName;
+  int iloads, gap, dialect, arg, csv;
+  long count, i, refPeriod;
+  long long cyclePeriod;
   iloads = 0;
+  refPeriod = 0;
+  cyclePeriod = 0;
+  statsName = NULL;
+  for (arg = 1; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+    if (strcmp(argv[arg], "-s") == 0)
+      refPeriod = atol(argv[arg + 1]);
+    else if (strcmp(argv[arg], "-c") == 0)
+      cyclePeriod = atoll(argv[arg + 1]);
+    else if (strcmp(argv[arg], "-o") == 0)
+      statsName = argv[arg + 1];
+    else
+      break;
+  }
+  if ((arg < argc && argv[arg][0] == '-') || refPeriod < 0 || cyclePeriod < 0) {
+    cerr << "Usage: " << argv[0] << " [-s <refs>] [-c <cycles>] [-o <stats file>]"
+         << " [<gap> [<format>]] < trace" << endl;
+    return 1;
+  }
+  gap = (arg < argc) ? atoi(argv[arg]) : COMPUTE_GAP;
+  dialect = (arg + 1 < argc) ? traceDialectByName(argv[arg + 1]) : TRACE_DIALECT_UNKNOWN;
+  if (arg + 1 < argc && dialect == TRACE_DIALECT_UNKNOWN) {
+    cerr << "Error: Unknown trace format " << argv[arg + 1] << endl;
+    return 1;
+  }
 
-  while (cin >> type >> hex >> addr) {
-    if (type == 0 || type == 1) {  // a load of some sort
-      if (type == 0) {
-	iloads++;
+  stats = NULL;
+  csv = 0;
+  if (refPeriod > 0 || cyclePeriod > 0) {
+    stats = stdout;
+    if (statsName != NULL) {
+      stats = fopen(statsName, "w");
+      if (stats == NULL) {
+        cerr << "Error: Cannot write " << statsName << endl;
+        return 1;
       }
-      hit = cache.read(addr);
+      csv = strlen(statsName) > 4 && strcmp(statsName + strlen(statsName) - 4, ".csv") == 0;
     }
-    else {                         // store 
-      hit = cache.write(addr);
+  }
+  Snapshots snapshots(stats, csv, refPeriod, cyclePeriod, cache, wb, clock);
+
+  in = traceDecompress(stdin);
+  input = (in != NULL) ? traceInputOpen(in, dialect) : NULL;
+  if (input == NULL) {
+    cerr << "Error: Unrecognized trace format" << endl;
+    return 1;
+  }
+
+  while ((count = traceInputRead(input, refs, TRACE_BATCH)) > 0) {
+    for (i = 0; i < count; i++) {
+      TraceRef& ref = refs[i];
+      if (ref.type == TRACE_INVALID)
+        continue;
+      if (ref.has_time) {
+        if ((long long)ref.time > clock.time())
+          wb.advanceCycles((long long)ref.time - clock.time());
+      }
+      else
+        wb.advanceCycles(gap);
+
+      if (ref.type == TRACE_IFETCH || ref.type == TRACE_READ) {  // a load of some sort
+        if (ref.type == TRACE_IFETCH) {
+          iloads++;
+        }
+        cache.read(ref.address);
+      }
+      else {                         // store 
+        cache.write(ref.address);
+      }
+      snapshots.reference();
     }
   }
+  if (count < 0)
+    cerr << "Error: Corrupt binary trace" << endl;
+  traceInputClose(input);
+  traceClose(in);
+  snapshots.finish();
+  if (stats != NULL && stats != stdout)
+    fclose(stats);
 
   // print stats
 
   cout << "\n** Cache Statistics **\n\n";
   cache.report(cout);
+  wb.report(cout);
   cout << "# Instructions = " << iloads << " references/ins = " <<
     ((float)cache.references()) / iloads << endl;
+  return 0;
 }
\ No newline at end of file
@@ -1,15 +1,82 @@
-#include <iostream.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <iostream>
+#include <deque>
+#include <queue>
+#include <vector>
+
+using namespace std;
+
+/**
+   A memory transaction on the bus, due to finish at a given cycle.
+*/
+struct Event {
+  long long time;
+  int kind;     // READ_DONE or WRITE_DONE
+  uint64_t addr;
+};
+
+enum { READ_DONE, WRITE_DONE };
+
+/** The counters a Snapshots row reports, as indexes into a sample. */
+enum {
+  READ_HITS, READ_MISSES, WRITE_HITS, WRITE_MISSES,
+  READ_STALLS, WRITE_STALLS,              // from the Cache
+  BUS_BUSY, RAW_STALLS, BUS_STALLS, WB_STALLS,  // from the WriteBuffer
+  NUM_STATS
+};
+
+/** Orders the event queue soonest first. */
+struct Later {
+  bool operator()(const Event& a, const Event& b) const { return a.time > b.time; }
+};
+
+/**
+   The Clock holds the global cycle count and the queue of memory
+   transactions still in flight.  Time never ticks a cycle at a time:
+   it jumps straight to the next reference or the next event, so idle
+   stretches cost nothing to simulate.
+*/
+class Clock {
+public:
+  Clock() : now(0) {}
+
+  /** Answer the current cycle. */
+  long long time() const { return now; }
+
+  /** Queue a transaction that finishes delay cycles from now. */
+  void schedule(int delay, int kind, uint64_t addr);
+
+  /** Answer whether any transaction is still in flight. */
+  int pending() const { return !events.empty(); }
+
+  /** Answer the cycle the next transaction finishes. */
+  long long nextTime() const { return events.top().time; }
+
+  /** Remove the next transaction and move the clock up to it. */
+  Event next();
+
+  /** Move the clock up to cycle t, if it is not there already. */
+  void skipTo(long long t) { if (t > now) now = t; }
+
+private:
+  long long now;
+  priority_queue<Event, vector<Event>, Later> events;
+};
 
 /**
    All of our writes to the next level of memory go through a
-   WriteBuffer.  If we create a writebuffer of size 0, this is a
-   special case which models no write buffer.  In this case, all
-   writes cost the full memory latency.  Otherwise, items can be added
-   to the writebuffer, at no cost, provided that the buffer is not
-   full.  If it is full, we must wait until it has completely written
-   the current item.  When performing a read, we must be sure to first
-   request that the WriteBuffer relinquish the bus (ie. finish writing
-   the current item, if any exists).  
+   WriteBuffer, which also owns the bus to memory.  If we create a
+   writebuffer of size 0, this is a special case which models no write
+   buffer.  In this case, all writes cost the full memory latency.
+   Otherwise, items can be added to the writebuffer, at no cost,
+   provided that the buffer is not full.  If it is full, we must wait
+   until its oldest item has been written.  The buffer drains one item
+   at a time whenever the bus is free, as WRITE_DONE events on the
+   Clock.  A read miss must first wait for any buffered write to the
+   same line, then for the WriteBuffer to relinquish the bus (ie.
+   finish writing the current item, if any exists), and then holds the
+   bus until its line arrives.
 */
 class WriteBuffer {
 public:
@@ -17,33 +84,58 @@ public:
      Create a new WriteBuffer.
      @param size the maximum number of elements in the WriteBuffer.
      @param cyclesPerItem the number of cycles to write a single item
+     @param clock the global clock.
   */
-  WriteBuffer(int size, int cyclesPerItem);
+  WriteBuffer(int size, int cyclesPerItem, Clock& clock);
 
   /**
-    Complete the current write.
-    @returns the number of cycles we waited
+     Add one item to the writebuffer
+     @returns the number of cycles we waited (if the buffer was full).
   */
-  int relinquishBus();   
+  long long addItem(uint64_t addr);
 
   /**
-     Add one item to the writebuffer
-     @returns the number of cycles we waited (if the buffer was full).
+     Read a line from memory over the bus.
+     @param addr the address missed on.
+     @param lineSize the line size in bytes.
+     @param penalty the number of cycles the bus takes to bring it in.
+     @returns the number of cycles we waited, penalty included.
   */
-  int addItem(int addr);
+  long long readLine(uint64_t addr, int lineSize, int penalty);
 
   /**
-     Give the write buffer some cycles.
-     @returns the number of cycles it actually consumed.
+     Give the write buffer some cycles, letting it drain while the
+     processor computes.
+     @returns the number of items it wrote meanwhile.
   */
-  int advanceCycles(int cycles);
+  int advanceCycles(long long cycles);
+
+  /** Dump the timing statistics to the output stream. */
+  void report(ostream& os);
+
+  /** Copy the timing counters into their slots of a sample. */
+  void sample(long long* stats);
 
 private:
+  Clock& clock;
+  deque<uint64_t> items;    // front is on the bus when writing
   int memLatency;
-  int maxCycles;
-  int cyclesUntilEmpty;
-  int isEmpty() { return cyclesUntilEmpty == 0; }
-  int isFull() { return cyclesUntilEmpty > maxCycles - memLatency; }
+  int maxItems;
+  int writing;          // a write is on the bus
+  int held;             // a read holds the bus
+  long long busyCycles;
+  long long rawStallCycles, busStallCycles, writeStallCycles;
+  int isFull() { return (int)items.size() >= maxItems; }
+  int holds(uint64_t addr, int lineSize);
+  /**
+    Complete the current write, holding the bus so the next one does
+    not start.  Only readLine calls this, and its READ_DONE event
+    releases the bus again.
+    @returns the number of cycles we waited
+  */
+  long long relinquishBus();
+  void startNext();
+  void dispatch(const Event& e);
 };
   
 
@@ -64,7 +156,7 @@ public:
      @param writeBuffer the writeBuffer we're using.
      @param cycles the number of cycles we stalled.
   */
-  int read(int addr, WriteBuffer& writeBuffer, int& cycles);
+  int read(uint64_t addr, WriteBuffer& writeBuffer, long long& cycles);
 
   /**
      Write to this address.
@@ -72,10 +164,10 @@ public:
      @param writeBuffer the writeBuffer we're using.
      @param cycles the number of cycles we stalled.
   */
-  int write(int addr, WriteBuffer& writeBuffer, int& cycles);
+  int write(uint64_t addr, WriteBuffer& writeBuffer, long long& cycles);
 
  protected:
-  int tag;
+  uint64_t tag;
   int valid;
 };
  
@@ -96,17 +188,20 @@ public:
   */
   Cache(int lines, int blockSizeInBytes, WriteBuffer& wb);
 
+  /** Free the blocks. */
+  ~Cache() { delete[] blocks; }
+
   /**
      Read this address
      @returns 1 for hit, 0 for miss
   */
-  int read(int addr);
+  int read(uint64_t addr);
 
   /**
      Write this address
      @returns 1 for hit, 0 for miss
   */
-  int write(int addr);
+  int write(uint64_t addr);
 
   /** Dump the statistics to the output stream.  */
   void report(ostream& os);
@@ -114,15 +209,52 @@ public:
   /** Answer the total number of references. */
   int references() { return readHits+readMisses+writeHits+writeMisses; }
 
+  /** Copy the hit, miss and stall counters into their slots of a sample. */
+  void sample(long long* stats);
+
 private:
   CacheBlock* blocks;
   WriteBuffer& writeBuffer;
   int numBlocks, blockSize;
   int readHits, readMisses, writeHits, writeMisses;
-  int readStallCycles, writeStallCycles;
-  void updateStats(int hit, int cycles, int& hits, int& misses, int& cycleCt);
+  long long readStallCycles, writeStallCycles;
+  void updateStats(int hit, long long cycles, int& hits, int& misses, long long& cycleCt);
 };
 
 
+/**
+   Snapshots writes the Cache and WriteBuffer counters every so many
+   references or cycles while the trace runs, so that phase behavior
+   shows before the end.  Each row has the running totals followed by
+   the counts for that interval alone.  Rows are JSON lines, or CSV
+   (with a header) for a stats file whose name ends in .csv.
+*/
+class Snapshots {
+public:
+  /**
+     Create a new Snapshots.
+     @param out where the rows go.
+     @param csv write CSV rather than JSON lines.
+     @param refPeriod references between rows, 0 for none.
+     @param cyclePeriod cycles between rows, 0 for none.
+  */
+  Snapshots(FILE* out, int csv, long refPeriod, long long cyclePeriod,
+            Cache& cache, WriteBuffer& wb, Clock& clock);
+
+  /** Count a reference, writing a row if one is due. */
+  void reference();
 
+  /** Write a last row for the references since the previous one. */
+  void finish();
 
+private:
+  FILE* out;
+  int csv;
+  long refPeriod, refs, lastRefs;
+  long long cyclePeriod, nextCycle;
+  Cache& cache;
+  WriteBuffer& writeBuffer;
+  Clock& clock;
+  long long last[NUM_STATS];  // totals at the previous row
+  void take();
+};
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Checks that sidecar indexes written by ./sim -i do not depend on -r,
+# and that -r gives the same results with and without an index. sim
+# exits with 1 on success, so only its output is checked.
+#
+# Usage: sh index_check.sh (or make check)
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+trace="$dir/trace.txt"
+
+awk 'BEGIN { srand(5); for(i = 0; i < 20000; i++) printf("0x%x: %s 0x%x\n", 4096 + i % 64 * 4, rand() < 0.3 ? "W" : "R", int(rand() * 65536) * 4) }' > "$trace"
+
+status=0
+fail()
+{
+    echo "FAIL: $1"
+    status=1
+}
+
+./sim -m -j 3 -r 1000:500 wb "$trace" > "$dir/plain.out" 2>/dev/null
+grep -q "CACHE HITS" "$dir/plain.out" || fail "-r without an index printed no results"
+
+./sim -m -j 3 -i 100 wb "$trace" > /dev/null 2>&1
+[ -s "$trace.idx" ] || fail "-i wrote no index"
+cp "$trace.idx" "$dir/full.idx"
+
+./sim -m -j 3 -r 1000:500 wb "$trace" > "$dir/seek.out" 2>/dev/null
+cmp -s "$trace.idx" "$dir/full.idx" || fail "-r changed the index"
+cmp -s "$dir/plain.out" "$dir/seek.out" || fail "-r gave different results with an index"
+
+./sim -m -j 3 -i 100 -r 1000:500 wb "$trace" > "$dir/both.out" 2>/dev/null
+cmp -s "$trace.idx" "$dir/full.idx" || fail "-i -r wrote a different index"
+cmp -s "$dir/plain.out" "$dir/both.out" || fail "-i -r gave different results"
+
+./sim -m -i 100 -r 5000:10 wb "$trace" > /dev/null 2>&1
+cmp -s "$trace.idx" "$dir/full.idx" || fail "-i -r on one thread wrote a different index"
+
+[ $status -eq 0 ] && echo "index checks passed"
+exit $status
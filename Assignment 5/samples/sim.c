@@ -1,32 +1,79 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "sim.h"
+#include "../trace/trace.h"
 
-struct Block_ {
-    int valid;
-    char* tag;
-    int dirty;
-};
+/* Bitset Helpers
+ *
+ * The valid and dirty flags are packed one bit per line into arrays of
+ * unsigned longs.
+ */
+
+#define WORD_BITS (8 * sizeof(unsigned long))
+#define BITSET_WORDS(n) (((n) + WORD_BITS - 1) / WORD_BITS)
+#define BIT_TEST(set, i) (((set)[(i) / WORD_BITS] >> ((i) % WORD_BITS)) & 1UL)
+#define BIT_SET(set, i) ((set)[(i) / WORD_BITS] |= 1UL << ((i) % WORD_BITS))
+#define BIT_CLEAR(set, i) ((set)[(i) / WORD_BITS] &= ~(1UL << ((i) % WORD_BITS)))
+
+/* References handed out by the trace reader at a time */
+#define TRACE_BATCH 1024
+
+typedef struct Prefetcher_ Prefetcher;
+typedef struct VictimCache_ VictimCache;
+typedef struct WriteBuffer_ WriteBuffer;
 
 struct Cache_ {
-    int hits;
-    int misses;
-    int reads;
-    int writes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t reads;
+    uint64_t writes;
     int cache_size;
     int block_size;
     int numLines;
+    int associativity;
+    int numSets;
     int write_policy;
-    Block* blocks;    
+    int offset_bits;
+    int index_bits;
+    unsigned int offset_mask;
+    unsigned int index_mask;
+    
+    /* Line metadata, stored as one contiguous array per field and
+       indexed by set * associativity + way. Tags start out 32 bits
+       wide and move to wide_tags the first time a tag needs more. */
+    unsigned int* tags;
+    uint64_t* wide_tags;
+    unsigned long* valid;
+    unsigned long* dirty;
+    
+    /* Recency rank of each way within its set, 0 being the most
+       recently used. Only allocated when associativity > 1. */
+    unsigned short* lru;
+    
+    /* Prefetch engine, NULL unless one was attached with -P */
+    Prefetcher* prefetcher;
+    
+    /* Victim cache and write buffer behind the cache, NULL unless
+       given with -v and -w */
+    VictimCache* victims;
+    WriteBuffer* buffer;
 };
 
-unsigned int htoi(const char str[])
+uint64_t htoi(const char str[])
 {
     /* Local Variables */
-    unsigned int result;
+    uint64_t result;
     int i;
 
     i = 0;
@@ -54,148 +101,1579 @@ unsigned int htoi(const char str[])
     return result;
 }
 
-char *getBinary(unsigned int num)
+/* splitAddress
+ *
+ * Splits an address into its tag, index and offset fields using the
+ * shifts and masks derived from the cache geometry in createCache.
+ */
+
+static void splitAddress(Cache cache, uint64_t address, uint64_t *tag, unsigned int *index, unsigned int *offset)
+{
+    *offset = (unsigned int)address & cache->offset_mask;
+    *index = (unsigned int)(address >> cache->offset_bits) & cache->index_mask;
+    *tag = address >> (cache->offset_bits + cache->index_bits);
+}
+
+/* lineTag
+ *
+ * Returns the tag stored for a line, whichever width the tags are.
+ */
+
+#define lineTag(cache, line) ((cache)->wide_tags != NULL ? (cache)->wide_tags[line] : (uint64_t)(cache)->tags[line])
+
+/* setLineTag
+ *
+ * Stores the tag for a line. The first tag that does not fit in 32 bits
+ * copies every tag into a 64 bit array, so traces with small addresses
+ * never pay for the wider metadata.
+ */
+
+static void setLineTag(Cache cache, unsigned int line, uint64_t tag)
 {
-    char* bstring;
     int i;
-    
-    /* Calculate the Binary String */
-    
-    bstring = (char*) malloc(sizeof(char) * 33);
-    assert(bstring != NULL);
-    
-    bstring[32] = '\0';
-    
-    for( i = 0; i < 32; i++ )
+
+    if(cache->wide_tags == NULL && tag > 0xffffffffUL)
     {
-        bstring[32 - 1 - i] = (num == ((1 << i) | num)) ? '1' : '0';
+        cache->wide_tags = (uint64_t*) malloc( sizeof(uint64_t) * cache->numLines );
+        assert(cache->wide_tags != NULL);
+        for(i = 0; i < cache->numLines; i++)
+        {
+            cache->wide_tags[i] = cache->tags[i];
+        }
+        free(cache->tags);
+        cache->tags = NULL;
+    }
+
+    if(cache->wide_tags != NULL)
+    {
+        cache->wide_tags[line] = tag;
+    }
+    else
+    {
+        cache->tags[line] = (unsigned int)tag;
     }
-    
-    return bstring;
 }
 
-char *formatBinary(char *bstring)
+/* isPowerOfTwo
+ *
+ * Returns 1 if n is a positive power of two, 0 otherwise.
+ */
+
+static int isPowerOfTwo(long n)
 {
-    char *formatted;
-    int i;
-    
-    /* Format for Output */
-    
-    formatted = (char *) malloc(sizeof(char) * 35);
-    assert(formatted != NULL);
-    
-    formatted[34] = '\0';
-    
-    for(i = 0; i < TAG; i++)
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+/* log2i
+ *
+ * Returns the base 2 logarithm of a power of two.
+ */
+
+static int log2i(unsigned int n)
+{
+    int bits;
+
+    bits = 0;
+    while(n > 1)
     {
-        formatted[i] = bstring[i];
+        n = n >> 1;
+        bits++;
     }
-    
-    formatted[TAG] = ' ';
-    
-    for(i = TAG + 1; i < INDEX + TAG + 1; i++)
+    return bits;
+}
+
+/* parseSize
+ *
+ * Parses a positive decimal size argument, accepting an optional k or m
+ * suffix for kilobytes or megabytes. Returns -1 if the argument is not a
+ * valid size.
+ */
+
+static long parseSize(const char *arg)
+{
+    long value;
+    char *end;
+
+    value = strtol(arg, &end, 10);
+    if(end == arg || value <= 0)
     {
-        formatted[i] = bstring[i - 1];
+        return -1;
     }
-    
-    formatted[INDEX + TAG + 1] = ' ';
-    
-    for(i = INDEX + TAG + 2; i < OFFSET + INDEX + TAG + 2; i++)
+
+    if(tolower(*end) == 'k')
+    {
+        value = value * 1024;
+        end++;
+    }
+    else if(tolower(*end) == 'm')
+    {
+        value = value * 1024 * 1024;
+        end++;
+    }
+
+    if(*end != '\0')
     {
-        formatted[i] = bstring[i - 2];
+        return -1;
     }
+    return value;
+}
+
+/* touchLine
+ *
+ * Marks a line as the most recently used in its set.
+ */
 
-    return formatted;
+static void touchLine(Cache cache, unsigned int set, unsigned int line)
+{
+    unsigned short *rank;
+    unsigned short old;
+    int i;
+
+    rank = cache->lru + set * cache->associativity;
+    old = cache->lru[line];
+
+    for(i = 0; i < cache->associativity; i++)
+    {
+        if(rank[i] < old)
+        {
+            rank[i]++;
+        }
+    }
+    cache->lru[line] = 0;
 }
 
+/* findLine
+ *
+ * Looks up a tag in the given set. Returns the matching line and sets
+ * *hit to 1, or returns the line to replace (an invalid line if there
+ * is one, otherwise the least recently used) and sets *hit to 0.
+ */
 
-int btoi(char *bin)
+static unsigned int findLine(Cache cache, uint64_t tag, unsigned int index, int *hit)
 {
-    int  b, k, m, n;
-    int  len, sum;
+    unsigned int first, line, victim;
+    int i;
+
+    first = index * cache->associativity;
+
+    if(cache->associativity == 1)
+    {
+        *hit = BIT_TEST(cache->valid, first) && lineTag(cache, first) == tag;
+        return first;
+    }
+
+    victim = first;
+    for(i = 0; i < cache->associativity; i++)
+    {
+        line = first + i;
+        if(BIT_TEST(cache->valid, line))
+        {
+            if(lineTag(cache, line) == tag)
+            {
+                *hit = 1;
+                touchLine(cache, index, line);
+                return line;
+            }
+            if(BIT_TEST(cache->valid, victim) && cache->lru[line] > cache->lru[victim])
+            {
+                victim = line;
+            }
+        }
+        else if(BIT_TEST(cache->valid, victim))
+        {
+            victim = line;
+        }
+    }
 
-    sum = 0;
-    len = strlen(bin) - 1;
+    *hit = 0;
+    touchLine(cache, index, victim);
+    return victim;
+}
+
+/* Victim Cache and Write Buffer
+ *
+ * With -v, lines evicted from the cache go into a small fully
+ * associative victim cache instead of leaving. A miss that finds its
+ * line there swaps it back in without a memory read, and only dirty
+ * lines pushed out of the victim cache are written back.
+ *
+ * With -w, memory writes (write throughs and writebacks) go through a
+ * FIFO write buffer that drains one line to memory every <cycles>
+ * cycles. A write to a line already waiting in the buffer is merged
+ * into it. The clock advances one cycle per reference, plus the cycles
+ * the processor stalls when it writes to a full buffer. With no
+ * entries, every memory write stalls for the full <cycles>.
+ */
+
+struct VictimCache_ {
+    int size;
+    int count;
+    uint64_t *lines;            /* line numbers, least recently evicted first */
+    unsigned char *dirty;
+    long hits;
+};
+
+struct WriteBuffer_ {
+    int size;
+    int count;
+    long cycles;                /* cycles to drain one line */
+    uint64_t *lines;            /* pending line numbers, oldest first */
+    long *done;                 /* cycle each pending line finishes draining */
+    long free;                  /* cycle memory is next idle */
+    long stalls;
+    long coalesced;
+};
+
+/* attachBuffers
+ *
+ * Gives a cache a victim cache of <victims> lines and a write buffer of
+ * <entries> lines draining one per <cycles>. The victim cache is left
+ * out when <victims> is 0 and the write buffer when <entries> is -1.
+ *
+ * @return      success     1
+ * @return      failure     0
+ */
+
+static int attachBuffers(Cache cache, long victims, long entries, long cycles)
+{
+    if(victims > 0)
+    {
+        cache->victims = (VictimCache *) calloc(1, sizeof(VictimCache));
+        if(cache->victims == NULL)
+        {
+            return 0;
+        }
+        cache->victims->size = (int)victims;
+        cache->victims->lines = (uint64_t *) malloc(victims * sizeof(uint64_t));
+        cache->victims->dirty = (unsigned char *) malloc(victims);
+        if(cache->victims->lines == NULL || cache->victims->dirty == NULL)
+        {
+            return 0;
+        }
+    }
 
-    for(k = 0; k <= len; k++)
+    if(entries >= 0)
     {
-        n = (bin[k] - '0'); 
-        if ((n > 1) || (n < 0))
+        cache->buffer = (WriteBuffer *) calloc(1, sizeof(WriteBuffer));
+        if(cache->buffer == NULL)
         {
             return 0;
         }
-        for(b = 1, m = len; m > k; m--)
+        cache->buffer->size = (int)entries;
+        cache->buffer->cycles = cycles;
+        cache->buffer->lines = (uint64_t *) malloc((entries + 1) * sizeof(uint64_t));
+        cache->buffer->done = (long *) malloc((entries + 1) * sizeof(long));
+        if(cache->buffer->lines == NULL || cache->buffer->done == NULL)
         {
-            b *= 2;
+            return 0;
         }
-        sum = sum + n * b;
     }
-    return(sum);
+    return 1;
 }
 
-void parseMemoryAddress(char *address)
+/* memoryWrite
+ *
+ * Writes a line, given by its line number, to memory, through the write
+ * buffer if there is one.
+ */
+
+static void memoryWrite(Cache cache, uint64_t number)
 {
-    unsigned int dec;
-    char *bstring, *bformatted, *tag, *index, *offset;
+    WriteBuffer *wb;
+    long now;
     int i;
-    
-    dec = htoi(address);
-    bstring = getBinary(dec);
-    bformatted = formatBinary(bstring);
-    
-    if(DEBUG)
+
+    wb = cache->buffer;
+    if(wb == NULL)
     {
-        printf("Hex: %s\n", address);
-        printf("Decimal: %u\n", dec);
-        printf("Binary: %s\n", bstring);
-        printf("Formatted: %s\n", bformatted);
+        cache->writes++;
+        return;
     }
-    
-    i = 0;
-    
-    tag = (char *) malloc( sizeof(char) * (TAG + 1) );
-    assert(tag != NULL);
-    tag[TAG] = '\0';
-    
-    for(i = 0; i < TAG; i++)
+    now = (long)(cache->hits + cache->misses) + wb->stalls;
+
+    /* Retire what has drained by now */
+    for(i = 0; i < wb->count && wb->done[i] <= now; i++)
+        ;
+    wb->count -= i;
+    memmove(wb->lines, wb->lines + i, wb->count * sizeof(uint64_t));
+    memmove(wb->done, wb->done + i, wb->count * sizeof(long));
+
+    /* Merge into a pending line that has not started draining */
+    for(i = 0; i < wb->count; i++)
+    {
+        if(wb->lines[i] == number && wb->done[i] - wb->cycles > now)
+        {
+            wb->coalesced++;
+            return;
+        }
+    }
+
+    cache->writes++;
+    if(wb->size == 0)
+    {
+        wb->stalls += wb->cycles;
+        return;
+    }
+
+    /* Wait for the oldest line to drain */
+    if(wb->count == wb->size)
+    {
+        wb->stalls += wb->done[0] - now;
+        now = wb->done[0];
+        wb->count--;
+        memmove(wb->lines, wb->lines + 1, wb->count * sizeof(uint64_t));
+        memmove(wb->done, wb->done + 1, wb->count * sizeof(long));
+    }
+
+    wb->free = ((wb->free > now) ? wb->free : now) + wb->cycles;
+    wb->lines[wb->count] = number;
+    wb->done[wb->count] = wb->free;
+    wb->count++;
+}
+
+/* victimInsert
+ *
+ * Puts a line evicted from the cache into the victim cache, pushing out
+ * the least recently evicted line when it is full.
+ */
+
+static void victimInsert(Cache cache, uint64_t number, int dirty)
+{
+    VictimCache *vc;
+
+    vc = cache->victims;
+    if(vc->count == vc->size)
+    {
+        if(vc->dirty[0])
+        {
+            memoryWrite(cache, vc->lines[0]);
+        }
+        vc->count--;
+        memmove(vc->lines, vc->lines + 1, vc->count * sizeof(uint64_t));
+        memmove(vc->dirty, vc->dirty + 1, vc->count);
+    }
+    vc->lines[vc->count] = number;
+    vc->dirty[vc->count] = (unsigned char)dirty;
+    vc->count++;
+}
+
+/* victimCovers
+ *
+ * Looks for a missing line in the victim cache, taking it out if it is
+ * there.
+ *
+ * @param       cache       cache with a victim cache
+ * @param       address     address that missed
+ * @param       dirty       set to whether the line was dirty
+ *
+ * @return      not there   0
+ * @return      found       1
+ */
+
+static int victimCovers(Cache cache, uint64_t address, int *dirty)
+{
+    VictimCache *vc;
+    uint64_t number;
+    int i;
+
+    vc = cache->victims;
+    number = address >> cache->offset_bits;
+    for(i = 0; i < vc->count; i++)
+    {
+        if(vc->lines[i] == number)
+        {
+            *dirty = vc->dirty[i];
+            vc->count--;
+            memmove(vc->lines + i, vc->lines + i + 1, (vc->count - i) * sizeof(uint64_t));
+            memmove(vc->dirty + i, vc->dirty + i + 1, vc->count - i);
+            vc->hits++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* victimHolds
+ *
+ * Returns 1 if the victim cache holds a line, given by its line number,
+ * without taking it out.
+ */
+
+static int victimHolds(Cache cache, uint64_t number)
+{
+    VictimCache *vc;
+    int i;
+
+    vc = cache->victims;
+    for(i = 0; i < vc->count; i++)
+    {
+        if(vc->lines[i] == number)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Prefetching
+ *
+ * With -P, a prefetch engine watches the demand references and fetches
+ * lines ahead of them. <degree> sets how far ahead:
+ *
+ *      next    on a miss, or the first hit to a prefetched line, the
+ *              next <degree> lines are fetched into the cache.
+ *      stride  a table indexed by instruction PC learns the stride of
+ *              each load or store. Once a stride repeats, the lines up
+ *              to <degree> strides ahead are fetched into the cache.
+ *              Only references that carry a PC (swift traces) train it.
+ *      stream  STREAM_BUFFERS FIFO buffers of <degree> sequential lines
+ *              sit beside the cache. A miss that finds its line in a
+ *              buffer moves it into the cache instead of reading memory,
+ *              dropping the entries ahead of it. Any other miss restarts
+ *              the least recently used buffer at the line after it.
+ *
+ * Each prefetch is one memory read on top of the demand reads. A
+ * prefetch arrives <latency> references after it is issued. It is useful
+ * if a demand reference uses the line, and late if that happens before
+ * it arrives. It is useless if the line is evicted, dropped or still
+ * unused at the end. Misses covered by a prefetch count as hits, late
+ * ones included.
+ */
+
+#define PREFETCH_NONE 0
+#define PREFETCH_NEXT 1
+#define PREFETCH_STRIDE 2
+#define PREFETCH_STREAM 3
+
+#define STRIDE_TABLE 256        /* PCs the stride prefetcher tracks, a power of 2 */
+#define STRIDE_CONFIDENT 2      /* repeats of a stride before it is prefetched */
+#define STREAM_BUFFERS 4
+
+typedef struct StrideEntry_ {
+    uint64_t pc;
+    uint64_t last;              /* previous address */
+    int64_t stride;
+    int confidence;
+} StrideEntry;
+
+typedef struct StreamBuffer_ {
+    uint64_t head;              /* line number of the first entry */
+    int count;                  /* consecutive lines held from head */
+    long used;                  /* last reference that took from or restarted it */
+    long *ready;                /* arrival of each entry */
+} StreamBuffer;
+
+struct Prefetcher_ {
+    int kind;
+    int degree;
+    long latency;
+    long now;                   /* demand references so far */
+    uint64_t pc;                /* PC of the current reference */
+    int has_pc;
+    unsigned long *prefetched;  /* lines prefetched and not used yet */
+    long *ready;                /* arrival of each prefetched line */
+    StrideEntry *table;
+    StreamBuffer buffers[STREAM_BUFFERS];
+    long issued;
+    long useful;
+    long late;
+    long useless;
+};
+
+/* parsePrefetcher
+ *
+ * Parses a -P argument, <kind>[:<degree>]. Returns the kind and sets
+ * *degree, or returns -1 if the argument is not valid.
+ */
+
+static int parsePrefetcher(const char *arg, int *degree)
+{
+    static const char *names[] = { "next", "stride", "stream" };
+    const char *colon;
+    size_t length;
+    long value;
+    int kind;
+
+    colon = strchr(arg, ':');
+    length = (colon != NULL) ? (size_t)(colon - arg) : strlen(arg);
+    value = (colon != NULL) ? parseSize(colon + 1) : DEFAULT_PREFETCH_DEGREE;
+    if(value <= 0 || value > 64)
+    {
+        return -1;
+    }
+
+    for(kind = 0; kind < 3; kind++)
+    {
+        if(strlen(names[kind]) == length && strncmp(arg, names[kind], length) == 0)
+        {
+            *degree = (int)value;
+            return kind + 1;
+        }
+    }
+    return -1;
+}
+
+/* attachPrefetcher
+ *
+ * Gives a cache a prefetch engine of the given kind.
+ *
+ * @return      success     1
+ * @return      failure     0
+ */
+
+static int attachPrefetcher(Cache cache, int kind, int degree, long latency)
+{
+    Prefetcher *pf;
+    int b;
+
+    pf = (Prefetcher *) calloc(1, sizeof(Prefetcher));
+    if(pf == NULL)
+    {
+        return 0;
+    }
+    pf->kind = kind;
+    pf->degree = degree;
+    pf->latency = latency;
+    pf->prefetched = (unsigned long *) calloc(BITSET_WORDS(cache->numLines), sizeof(unsigned long));
+    pf->ready = (long *) calloc(cache->numLines, sizeof(long));
+    if(kind == PREFETCH_STRIDE)
+    {
+        pf->table = (StrideEntry *) calloc(STRIDE_TABLE, sizeof(StrideEntry));
+    }
+    cache->prefetcher = pf;
+    if(pf->prefetched == NULL || pf->ready == NULL || (kind == PREFETCH_STRIDE && pf->table == NULL))
+    {
+        return 0;
+    }
+    for(b = 0; b < STREAM_BUFFERS && kind == PREFETCH_STREAM; b++)
+    {
+        pf->buffers[b].ready = (long *) malloc(degree * sizeof(long));
+        if(pf->buffers[b].ready == NULL)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* evictLine
+ *
+ * Evicts the line about to be replaced in a set, if it is valid. A
+ * dirty line is written back, or moves to the victim cache with the
+ * rest.
+ */
+
+static void evictLine(Cache cache, unsigned int line, unsigned int index)
+{
+    uint64_t number;
+    int dirty;
+
+    if(!BIT_TEST(cache->valid, line))
+    {
+        return;
+    }
+    dirty = cache->write_policy == 1 && BIT_TEST(cache->dirty, line);
+    BIT_CLEAR(cache->dirty, line);
+    if(cache->prefetcher != NULL && BIT_TEST(cache->prefetcher->prefetched, line))
+    {
+        cache->prefetcher->useless++;
+        BIT_CLEAR(cache->prefetcher->prefetched, line);
+    }
+
+    number = (lineTag(cache, line) << cache->index_bits) | index;
+    if(cache->victims != NULL)
+    {
+        victimInsert(cache, number, dirty);
+    }
+    else if(dirty)
+    {
+        memoryWrite(cache, number);
+    }
+}
+
+/* probeLine
+ *
+ * Returns 1 if the set holds tag, without touching the replacement
+ * order.
+ */
+
+static int probeLine(Cache cache, uint64_t tag, unsigned int index)
+{
+    unsigned int first;
+    int i;
+
+    first = index * cache->associativity;
+    for(i = 0; i < cache->associativity; i++)
+    {
+        if(BIT_TEST(cache->valid, first + i) && lineTag(cache, first + i) == tag)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* prefetchLine
+ *
+ * Fetches a line, given by its line number, into the cache unless it is
+ * already on chip, in the cache or the victim cache. A demand miss
+ * swaps a line back from the victim cache, dirty bit and all, so
+ * reading a second copy from memory would only duplicate it.
+ */
+
+static void prefetchLine(Cache cache, uint64_t number)
+{
+    Prefetcher *pf;
+    uint64_t tag;
+    unsigned int index, offset, line;
+    int hit;
+
+    pf = cache->prefetcher;
+    splitAddress(cache, number << cache->offset_bits, &tag, &index, &offset);
+    if(probeLine(cache, tag, index) || (cache->victims != NULL && victimHolds(cache, number)))
+    {
+        return;
+    }
+
+    line = findLine(cache, tag, index, &hit);
+    evictLine(cache, line, index);
+
+    BIT_SET(cache->valid, line);
+    BIT_SET(pf->prefetched, line);
+    setLineTag(cache, line, tag);
+    pf->ready[line] = pf->now + pf->latency;
+    pf->issued++;
+}
+
+/* refillStream
+ *
+ * Drops the first <drop> entries of a stream buffer, moves its head and
+ * prefetches lines until it is full again.
+ */
+
+static void refillStream(Prefetcher *pf, StreamBuffer *buffer, uint64_t head, int drop)
+{
+    buffer->count -= drop;
+    memmove(buffer->ready, buffer->ready + drop, buffer->count * sizeof(long));
+    buffer->head = head;
+    while(buffer->count < pf->degree)
+    {
+        buffer->ready[buffer->count++] = pf->now + pf->latency;
+        pf->issued++;
+    }
+    buffer->used = pf->now;
+}
+
+/* prefetchCovers
+ *
+ * Called on a demand miss. Looks for the missing line in the stream
+ * buffers, or restarts one after it.
+ *
+ * @param       cache       cache with a prefetcher
+ * @param       address     address that missed
+ *
+ * @return      memory read 0
+ * @return      prefetched  1
+ */
+
+static int prefetchCovers(Cache cache, uint64_t address)
+{
+    Prefetcher *pf;
+    StreamBuffer *buffer, *oldest;
+    uint64_t number;
+    int b, position;
+
+    pf = cache->prefetcher;
+    if(pf->kind != PREFETCH_STREAM)
+    {
+        return 0;
+    }
+
+    number = address >> cache->offset_bits;
+    oldest = &pf->buffers[0];
+    for(b = 0; b < STREAM_BUFFERS; b++)
+    {
+        buffer = &pf->buffers[b];
+        if(number >= buffer->head && number - buffer->head < (uint64_t)buffer->count)
+        {
+            position = (int)(number - buffer->head);
+            pf->useless += position;
+            pf->useful++;
+            if(buffer->ready[position] > pf->now)
+            {
+                pf->late++;
+            }
+            refillStream(pf, buffer, number + 1, position + 1);
+            return 1;
+        }
+        if(buffer->used < oldest->used)
+        {
+            oldest = buffer;
+        }
+    }
+
+    pf->useless += oldest->count;
+    oldest->count = 0;
+    refillStream(pf, oldest, number + 1, 0);
+    return 0;
+}
+
+/* prefetchTrain
+ *
+ * Called after every demand reference. Counts the first use of a
+ * prefetched line, trains the prefetcher and issues its prefetches.
+ *
+ * @param       cache       cache with a prefetcher
+ * @param       address     address referenced
+ * @param       line        line that now holds it
+ * @param       hit         1 if the reference hit
+ */
+
+static void prefetchTrain(Cache cache, uint64_t address, unsigned int line, int hit)
+{
+    Prefetcher *pf;
+    StrideEntry *entry;
+    uint64_t number, target, previous;
+    int64_t stride;
+    int k, trigger;
+
+    pf = cache->prefetcher;
+    number = address >> cache->offset_bits;
+    trigger = !hit;
+    if(hit && BIT_TEST(pf->prefetched, line))
     {
-        tag[i] = bformatted[i];
+        BIT_CLEAR(pf->prefetched, line);
+        pf->useful++;
+        if(pf->ready[line] > pf->now)
+        {
+            pf->late++;
+        }
+        trigger = 1;
+    }
+
+    if(pf->kind == PREFETCH_NEXT && trigger)
+    {
+        for(k = 1; k <= pf->degree; k++)
+        {
+            prefetchLine(cache, number + k);
+        }
+    }
+    else if(pf->kind == PREFETCH_STRIDE && pf->has_pc)
+    {
+        entry = &pf->table[(size_t)((pf->pc * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & (STRIDE_TABLE - 1)];
+        if(entry->pc != pf->pc)
+        {
+            entry->pc = pf->pc;
+            entry->stride = 0;
+            entry->confidence = 0;
+        }
+        else
+        {
+            stride = (int64_t)(address - entry->last);
+            if(stride != 0 && stride == entry->stride)
+            {
+                if(entry->confidence < STRIDE_CONFIDENT)
+                {
+                    entry->confidence++;
+                }
+            }
+            else
+            {
+                entry->stride = stride;
+                entry->confidence = 0;
+            }
+        }
+        entry->last = address;
+
+        if(entry->confidence == STRIDE_CONFIDENT)
+        {
+            previous = number;
+            for(k = 1; k <= pf->degree; k++)
+            {
+                target = (address + (uint64_t)entry->stride * k) >> cache->offset_bits;
+                if(target != previous)
+                {
+                    prefetchLine(cache, target);
+                    previous = target;
+                }
+            }
+        }
+    }
+    pf->now++;
+}
+
+/* printPrefetches
+ *
+ * Counts the prefetches still unused as useless and prints the
+ * prefetch statistics.
+ */
+
+static void printPrefetches(Cache cache)
+{
+    Prefetcher *pf;
+    int i;
+
+    pf = cache->prefetcher;
+    for(i = 0; i < cache->numLines; i++)
+    {
+        if(BIT_TEST(pf->prefetched, i))
+        {
+            pf->useless++;
+        }
+    }
+    for(i = 0; i < STREAM_BUFFERS; i++)
+    {
+        pf->useless += pf->buffers[i].count;
+    }
+
+    printf("PREFETCH READS: %li\nUSEFUL PREFETCHES: %li\nLATE PREFETCHES: %li\nUSELESS PREFETCHES: %li\n", pf->issued, pf->useful, pf->late, pf->useless);
+    printf("PREFETCH ACCURACY: %f\nPREFETCH COVERAGE: %f\nTOTAL MEMORY READS: %lu\n",
+        pf->issued > 0 ? (double)pf->useful / pf->issued : 0.0,
+        pf->useful + cache->misses > 0 ? (double)pf->useful / (pf->useful + cache->misses) : 0.0,
+        (unsigned long)(cache->reads + pf->issued));
+}
+
+/* Interval Statistics
+ *
+ * With -s, a snapshot of the counters is written every <period>
+ * references, one JSON object per line or, when the stats file ends in
+ * .csv, one CSV row. Each snapshot holds the running totals followed by
+ * the counts for that interval alone, including the -w buffer's stall
+ * cycles and coalesced writes (0 without -w). With -x, the run stops early once
+ * the interval miss ratio has stayed within <tolerance> of the running
+ * miss ratio for CONVERGED_SNAPSHOTS snapshots in a row.
+ */
+
+#define CONVERGED_SNAPSHOTS 3
+
+typedef struct Snapshots_ {
+    FILE *out;
+    int csv;
+    long interval;          /* references per snapshot, 0 for none */
+    double tolerance;       /* convergence bound, < 0 to never stop early */
+    long next;              /* reference count of the next snapshot, -1 for none */
+    long last;              /* reference count of the previous snapshot */
+    uint64_t hits;          /* totals at the previous snapshot */
+    uint64_t misses;
+    uint64_t reads;
+    uint64_t writes;
+    long stalls;            /* write buffer totals at the previous snapshot */
+    long coalesced;
+    int steady;             /* snapshots in a row within tolerance */
+} Snapshots;
+
+/* takeSnapshot
+ *
+ * Writes a snapshot of the counters after <refs> references and checks
+ * whether the miss ratio has converged.
+ *
+ * @param       cache       cache being simulated
+ * @param       stats       snapshot settings and previous totals
+ * @param       refs        references simulated so far
+ *
+ * @return      keep going  0
+ * @return      converged   1
+ */
+
+static int takeSnapshot(Cache cache, Snapshots *stats, long refs)
+{
+    uint64_t hits, misses, reads, writes;
+    long stalls, coalesced;
+    double ratio, recent, drift;
+
+    stalls = (cache->buffer != NULL) ? cache->buffer->stalls : 0;
+    coalesced = (cache->buffer != NULL) ? cache->buffer->coalesced : 0;
+    hits = cache->hits - stats->hits;
+    misses = cache->misses - stats->misses;
+    reads = cache->reads - stats->reads;
+    writes = cache->writes - stats->writes;
+    ratio = (cache->hits + cache->misses > 0) ? (double)cache->misses / (cache->hits + cache->misses) : 0.0;
+    recent = (hits + misses > 0) ? (double)misses / (hits + misses) : 0.0;
+
+    if(stats->csv)
+    {
+        fprintf(stats->out, "%li,%lu,%lu,%lu,%lu,%li,%li,%f,%lu,%lu,%lu,%lu,%li,%li,%f\n",
+            refs, (unsigned long)cache->hits, (unsigned long)cache->misses, (unsigned long)cache->reads, (unsigned long)cache->writes, stalls, coalesced, ratio,
+            (unsigned long)hits, (unsigned long)misses, (unsigned long)reads, (unsigned long)writes, stalls - stats->stalls, coalesced - stats->coalesced, recent);
+    }
+    else
+    {
+        fprintf(stats->out, "{\"refs\": %li, \"hits\": %lu, \"misses\": %lu, \"reads\": %lu, \"writes\": %lu, ",
+            refs, (unsigned long)cache->hits, (unsigned long)cache->misses, (unsigned long)cache->reads, (unsigned long)cache->writes);
+        fprintf(stats->out, "\"stall_cycles\": %li, \"coalesced_writes\": %li, \"miss_ratio\": %f, ", stalls, coalesced, ratio);
+        fprintf(stats->out, "\"interval_hits\": %lu, \"interval_misses\": %lu, \"interval_reads\": %lu, \"interval_writes\": %lu, ",
+            (unsigned long)hits, (unsigned long)misses, (unsigned long)reads, (unsigned long)writes);
+        fprintf(stats->out, "\"interval_stall_cycles\": %li, \"interval_coalesced_writes\": %li, \"interval_miss_ratio\": %f}\n",
+            stalls - stats->stalls, coalesced - stats->coalesced, recent);
+    }
+
+    stats->last = refs;
+    stats->next = refs + stats->interval;
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->reads = cache->reads;
+    stats->writes = cache->writes;
+    stats->stalls = stalls;
+    stats->coalesced = coalesced;
+
+    drift = (recent > ratio) ? recent - ratio : ratio - recent;
+    if(stats->tolerance >= 0 && drift <= stats->tolerance)
+    {
+        stats->steady++;
+    }
+    else
+    {
+        stats->steady = 0;
+    }
+
+    if(stats->steady >= CONVERGED_SNAPSHOTS)
+    {
+        fprintf(stderr, "Miss ratio converged after %li references, stopping.\n", refs);
+        return 1;
+    }
+    return 0;
+}
+
+/* Per-PC Statistics
+ *
+ * With -p, every reference that carries the PC of its instruction is
+ * also counted against that PC in an open addressing hash table, and
+ * the PCs with the most misses are listed at the end. A slot is free
+ * while its reads and writes are both 0. Slots are kept to 24 bytes
+ * since programs with many distinct PCs spill the table out of L1.
+ */
+
+#define PC_TABLE_START 1024
+
+typedef struct PcCount_ {
+    uint64_t pc;
+    unsigned int reads;
+    unsigned int writes;
+    unsigned int misses;        /* hits are the rest of reads + writes */
+    unsigned int memWrites;     /* writebacks, or write throughs in wt mode */
+} PcCount;
+
+typedef struct PcTable_ {
+    PcCount *slots;
+    size_t capacity;            /* a power of 2 */
+    size_t used;
+    int top;                    /* PCs to report */
+} PcTable;
+
+/* pcSlot
+ *
+ * Returns the slot for a PC in a table with room for it.
+ */
+
+static PcCount *pcSlot(PcCount *slots, size_t capacity, uint64_t pc)
+{
+    size_t i;
+
+    i = (size_t)((pc * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & (capacity - 1);
+    while((slots[i].reads != 0 || slots[i].writes != 0) && slots[i].pc != pc)
+    {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &slots[i];
+}
+
+/* countPc
+ *
+ * Adds one reference to a PC's counts, growing the table once it is
+ * half full.
+ *
+ * @param       table       per-PC table
+ * @param       pc          instruction address of the reference
+ * @param       type        TRACE_READ, TRACE_WRITE or TRACE_IFETCH
+ * @param       missed      1 if the reference missed
+ * @param       memWrites   memory writes the reference caused
+ *
+ * @return      success     1
+ * @return      failure     0
+ */
+
+static int countPc(PcTable *table, uint64_t pc, int type, int missed, int memWrites)
+{
+    PcCount *slot, *grown;
+    size_t i, capacity;
+
+    slot = pcSlot(table->slots, table->capacity, pc);
+    if(slot->reads == 0 && slot->writes == 0)
+    {
+        if(2 * (table->used + 1) > table->capacity)
+        {
+            capacity = table->capacity * 2;
+            grown = (PcCount *) calloc(capacity, sizeof(PcCount));
+            if(grown == NULL)
+            {
+                fprintf(stderr, "Error: Out of memory for the PC table.\n");
+                return 0;
+            }
+            for(i = 0; i < table->capacity; i++)
+            {
+                if(table->slots[i].reads != 0 || table->slots[i].writes != 0)
+                {
+                    *pcSlot(grown, capacity, table->slots[i].pc) = table->slots[i];
+                }
+            }
+            free(table->slots);
+            table->slots = grown;
+            table->capacity = capacity;
+            slot = pcSlot(grown, capacity, pc);
+        }
+        slot->pc = pc;
+        table->used++;
+    }
+
+    if(type == TRACE_WRITE)
+    {
+        slot->writes++;
+    }
+    else
+    {
+        slot->reads++;
+    }
+    slot->misses += missed;
+    slot->memWrites += memWrites;
+    return 1;
+}
+
+/* compareMisses
+ *
+ * qsort order for the report: most misses first, then by PC.
+ */
+
+static int compareMisses(const void *a, const void *b)
+{
+    const PcCount *x, *y;
+
+    x = (const PcCount *) a;
+    y = (const PcCount *) b;
+    if(x->misses != y->misses)
+    {
+        return (x->misses < y->misses) ? 1 : -1;
+    }
+    return (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+/* printTopPcs
+ *
+ * Prints the table->top PCs with the most misses.
+ */
+
+static void printTopPcs(PcTable *table)
+{
+    size_t i, n;
+
+    if(table->used == 0)
+    {
+        fprintf(stderr, "The trace has no PCs to report.\n");
+        return;
+    }
+
+    /* Pack the used slots to the front and sort them */
+    for(i = 0, n = 0; i < table->capacity; i++)
+    {
+        if(table->slots[i].reads != 0 || table->slots[i].writes != 0)
+        {
+            table->slots[n++] = table->slots[i];
+        }
+    }
+    qsort(table->slots, n, sizeof(PcCount), compareMisses);
+    if(n > (size_t)table->top)
+    {
+        n = (size_t)table->top;
+    }
+
+    printf("TOP %lu OF %lu PCS BY MISSES:\n", (unsigned long)n, (unsigned long)table->used);
+    printf("%-18s %10s %10s %10s %10s %10s\n", "PC", "READS", "WRITES", "HITS", "MISSES", "MEM WRITES");
+    for(i = 0; i < n; i++)
+    {
+        printf("0x%-16lx %10u %10u %10u %10u %10u\n", (unsigned long)table->slots[i].pc, table->slots[i].reads, table->slots[i].writes, table->slots[i].reads + table->slots[i].writes - table->slots[i].misses, table->slots[i].misses, table->slots[i].memWrites);
+    }
+    table->used = 0;
+}
+
+/* Mapped Trace Parsing
+ *
+ * A mapped trace is cut into chunks of about CHUNK_BYTES that end on
+ * newlines. Each round, up to one chunk per parser thread is parsed into
+ * an array of references, and the chunks are then simulated in file
+ * order, so the results never depend on the thread count. The first
+ * chunk is simulated as soon as its parser finishes, while the others
+ * are still parsing.
+ */
+
+#define CHUNK_BYTES (4 * 1024 * 1024)
+
+typedef struct MappedRef_ {
+    uint64_t address;
+    uint64_t pc;
+    unsigned int offset;    /* line start, relative to the chunk */
+    unsigned char type;     /* TRACE_READ, TRACE_WRITE, ... */
+    unsigned char has_pc;
+} MappedRef;
+
+typedef struct ParseJob_ {
+    int dialect;
+    const char *begin;
+    const char *end;
+    MappedRef *refs;
+    size_t count;
+    size_t capacity;
+    int failed;
+    int started;
+    pthread_t thread;
+} ParseJob;
+
+typedef struct MapOptions_ {
+    int threads;            /* parser threads */
+    long interval;          /* sidecar index entry every interval references, 0 for none */
+    long first;             /* first reference to simulate */
+    long count;             /* references to simulate, -1 for all */
+} MapOptions;
+
+typedef struct MapRun_ {
+    long next;              /* trace position of the next reference */
+    long counter;           /* references simulated */
+    int done;               /* range finished, only indexing goes on */
+    uint64_t *index;        /* sidecar index being built */
+    size_t indexCount;
+    size_t indexCapacity;
+} MapRun;
+
+/* parseChunk
+ *
+ * Parses every line of a chunk in place with the shared trace parser.
+ * Runs on a parser thread.
+ */
+
+static void *parseChunk(void *arg)
+{
+    ParseJob *job;
+    MappedRef *grown, *ref;
+    const char *p, *line;
+    TraceRef parsed;
+
+    job = (ParseJob *) arg;
+    job->count = 0;
+    p = job->begin;
+
+    while(p < job->end)
+    {
+        line = p;
+        if(!traceParseLine(job->dialect, &p, job->end, &parsed))
+        {
+            continue;
+        }
+
+        if(job->count == job->capacity)
+        {
+            job->capacity = (job->capacity == 0) ? 65536 : job->capacity * 2;
+            grown = (MappedRef *) realloc(job->refs, job->capacity * sizeof(MappedRef));
+            if(grown == NULL)
+            {
+                job->failed = 1;
+                return NULL;
+            }
+            job->refs = grown;
+        }
+        ref = &job->refs[job->count++];
+        ref->offset = (unsigned int)(line - job->begin);
+        ref->address = parsed.address;
+        ref->pc = parsed.pc;
+        ref->type = parsed.type;
+        ref->has_pc = parsed.has_pc;
+    }
+    return NULL;
+}
+
+/* simulateChunk
+ *
+ * Runs the parsed references of a chunk that fall inside the requested
+ * range through the cache, recording index entries, per-PC counts and
+ * snapshots along the way. When an index is being written, the whole
+ * trace is read for it even after the range ends.
+ *
+ * @return      more to do      0
+ * @return      range finished  1
+ * @return      failure         -1
+ */
+
+static int simulateChunk(Cache cache, const ParseJob *job, const char *data, const MapOptions *options, MapRun *run, Snapshots *stats, PcTable *pcs)
+{
+    const MappedRef *ref;
+    uint64_t *grown;
+    size_t k;
+    uint64_t misses, writes;
+
+    if(job->failed)
+    {
+        fprintf(stderr, "Error: Out of memory while parsing.\n");
+        return -1;
+    }
+
+    for(k = 0; k < job->count; k++, run->next++)
+    {
+        ref = &job->refs[k];
+
+        if(options->interval > 0 && run->next % options->interval == 0)
+        {
+            if(run->indexCount == run->indexCapacity)
+            {
+                run->indexCapacity = (run->indexCapacity == 0) ? 1024 : run->indexCapacity * 2;
+                grown = (uint64_t *) realloc(run->index, run->indexCapacity * sizeof(uint64_t));
+                if(grown == NULL)
+                {
+                    fprintf(stderr, "Error: Out of memory for the index.\n");
+                    return -1;
+                }
+                run->index = grown;
+            }
+            run->index[run->indexCount++] = (uint64_t)(job->begin - data) + ref->offset;
+        }
+
+        if(run->done || run->next < options->first)
+        {
+            continue;
+        }
+        if(options->count >= 0 && run->next >= options->first + options->count)
+        {
+            run->done = 1;
+            if(options->interval == 0)
+            {
+                return 1;
+            }
+            continue;
+        }
+
+        if(DEBUG) printf("%li: %i 0x%lx\n", run->counter, ref->type, (unsigned long)ref->address);
+
+        misses = cache->misses;
+        writes = cache->writes;
+        if(cache->prefetcher != NULL)
+        {
+            cache->prefetcher->pc = ref->pc;
+            cache->prefetcher->has_pc = ref->has_pc;
+        }
+        if(ref->type == TRACE_WRITE)
+        {
+            writeAddress(cache, ref->address);
+        }
+        else if(ref->type == TRACE_INVALID)
+        {
+            printf("%li: ERROR!!!!\n", run->counter);
+            return -1;
+        }
+        else
+        {
+            readAddress(cache, ref->address);
+        }
+        run->counter++;
+
+        if(pcs != NULL && ref->has_pc && !countPc(pcs, ref->pc, ref->type, (int)(cache->misses - misses), (int)(cache->writes - writes)))
+        {
+            return -1;
+        }
+
+        if(run->counter == stats->next && takeSnapshot(cache, stats, run->counter))
+        {
+            run->done = 1;
+            if(options->interval == 0)
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* simulateMappedTrace
+ *
+ * Memory maps a text trace and runs the requested range of references
+ * through the cache, parsing with options->threads threads. The dialect
+ * is guessed from the first line unless given. Starts from
+ * the closest entry of <path>.idx when the index matches the trace, or
+ * writes a new index of the whole trace when options->interval is set.
+ * Prints the parse throughput to stderr.
+ *
+ * @param       cache       target cache struct
+ * @param       path        trace file name
+ * @param       dialect     text dialect, or TRACE_DIALECT_UNKNOWN
+ * @param       options     threads, index interval and reference range
+ * @param       stats       interval snapshot settings
+ * @param       pcs         per-PC table, or NULL
+ *
+ * @return      success     number of references simulated
+ * @return      failure     -1
+ */
+
+static long simulateMappedTrace(Cache cache, const char *path, int dialect, const MapOptions *options, Snapshots *stats, PcTable *pcs)
+{
+    int fd, n, k, status;
+    struct stat info;
+    struct timespec start, stop;
+    const char *data, *from, *p, *q, *end;
+    double seconds, megabytes;
+    char *indexPath;
+    uint64_t *offsets, entries, entry;
+    uint32_t interval;
+    ParseJob *jobs;
+    MapRun run;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Error: Could not open file.\n");
+        return -1;
+    }
+
+    if(fstat(fd, &info) != 0)
+    {
+        fprintf(stderr, "Error: Could not stat file.\n");
+        close(fd);
+        return -1;
+    }
+
+    if(info.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    data = (const char *) mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == (const char *) MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Could not map file.\n");
+        return -1;
+    }
+    posix_madvise((void *) data, (size_t)info.st_size, POSIX_MADV_SEQUENTIAL);
+
+    if(dialect == TRACE_DIALECT_UNKNOWN)
+    {
+        dialect = traceGuessDialect(data, data + ((info.st_size > CHUNK_BYTES) ? CHUNK_BYTES : info.st_size));
+    }
+    if(dialect == TRACE_DIALECT_UNKNOWN || dialect == TRACE_BINARY)
+    {
+        fprintf(stderr, "Error: Could not recognize the trace format.\n");
+        munmap((void *) data, (size_t)info.st_size);
+        return -1;
+    }
+
+    indexPath = (char *) malloc(strlen(path) + 5);
+    jobs = (ParseJob *) calloc((size_t)options->threads, sizeof(ParseJob));
+    if(indexPath == NULL || jobs == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory.\n");
+        free(indexPath);
+        free(jobs);
+        munmap((void *) data, (size_t)info.st_size);
+        return -1;
+    }
+    strcpy(indexPath, path);
+    strcat(indexPath, ".idx");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    memset(&run, 0, sizeof(run));
+    p = data;
+    end = data + info.st_size;
+
+    /* Jump to the last indexed reference at or before the range. A run
+       that writes a new index has to see the whole trace instead. */
+    if(options->first > 0 && options->interval == 0)
+    {
+        offsets = traceIndexRead(indexPath, (uint64_t)info.st_size, &interval, &entries);
+        if(offsets != NULL && entries > 0 && interval > 0)
+        {
+            entry = (uint64_t)options->first / interval;
+            if(entry >= entries)
+            {
+                entry = entries - 1;
+            }
+            if(offsets[entry] < (uint64_t)info.st_size)
+            {
+                p = data + offsets[entry];
+                run.next = (long)(entry * interval);
+            }
+        }
+        free(offsets);
+    }
+
+    from = p;
+    status = 0;
+    while(p < end && status == 0)
+    {
+        /* Cut and start the next round of chunks */
+        for(n = 0; n < options->threads && p < end; n++)
+        {
+            q = (end - p > CHUNK_BYTES) ? p + CHUNK_BYTES : end;
+            if(q < end)
+            {
+                q = (const char *) memchr(q, '\n', (size_t)(end - q));
+                q = (q == NULL) ? end : q + 1;
+            }
+            jobs[n].dialect = dialect;
+            jobs[n].begin = p;
+            jobs[n].end = q;
+            jobs[n].started = options->threads > 1 && pthread_create(&jobs[n].thread, NULL, parseChunk, &jobs[n]) == 0;
+            if(!jobs[n].started)
+            {
+                parseChunk(&jobs[n]);
+            }
+            p = q;
+        }
+
+        /* Simulate them in order */
+        for(k = 0; k < n; k++)
+        {
+            if(jobs[k].started)
+            {
+                pthread_join(jobs[k].thread, NULL);
+            }
+            if(status == 0)
+            {
+                status = simulateChunk(cache, &jobs[k], data, options, &run, stats, pcs);
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    if(status >= 0 && options->interval > 0)
+    {
+        if(traceIndexWrite(indexPath, (uint32_t)options->interval, (uint64_t)info.st_size, run.index, run.indexCount))
+        {
+            fprintf(stderr, "Wrote %lu index entries to %s\n", (unsigned long)run.indexCount, indexPath);
+        }
+        else
+        {
+            fprintf(stderr, "Error: Could not write %s.\n", indexPath);
+        }
+    }
+
+    seconds = (double)(stop.tv_sec - start.tv_sec) + (double)(stop.tv_nsec - start.tv_nsec) / 1e9;
+    megabytes = (double)(p - from) / (1024.0 * 1024.0);
+    if(status >= 0)
+    {
+        fprintf(stderr, "Parsed %.1f MB (%li references) on %i threads in %.3f s: %.1f MB/s\n", megabytes, run.counter, options->threads, seconds, seconds > 0 ? megabytes / seconds : 0.0);
+    }
+
+    for(k = 0; k < options->threads; k++)
+    {
+        free(jobs[k].refs);
+    }
+    free(jobs);
+    free(run.index);
+    free(indexPath);
+    munmap((void *) data, (size_t)info.st_size);
+    return (status < 0) ? -1 : run.counter;
+}
+
+/* simulateTrace
+ *
+ * Runs every reference of a trace stream through the cache, a batch at
+ * a time, using the shared reader for binary traces and every text
+ * dialect in trace.h. Instruction fetches are treated as reads.
+ *
+ * @param       cache       target cache struct
+ * @param       file        stream positioned at the start of the trace
+ * @param       dialect     text dialect, or TRACE_DIALECT_UNKNOWN
+ * @param       stats       interval snapshot settings
+ * @param       pcs         per-PC table, or NULL
+ *
+ * @return      success     number of references simulated
+ * @return      failure     -1
+ */
+
+static long simulateTrace(Cache cache, FILE *file, int dialect, Snapshots *stats, PcTable *pcs)
+{
+    TraceRef refs[TRACE_BATCH];
+    TraceInput input;
+    long count, k, counter;
+    uint64_t misses, writes;
+    int converged;
+
+    input = traceInputOpen(file, dialect);
+    if(input == NULL)
+    {
+        fprintf(stderr, "Error: Could not recognize the trace format.\n");
+        return -1;
+    }
+
+    counter = 0;
+    converged = 0;
+    while(!converged && (count = traceInputRead(input, refs, TRACE_BATCH)) > 0)
+    {
+        for(k = 0; k < count; k++)
+        {
+            if(DEBUG) printf("%li: %i 0x%lx\n", counter, refs[k].type, (unsigned long)refs[k].address);
+
+            misses = cache->misses;
+            writes = cache->writes;
+            if(cache->prefetcher != NULL)
+            {
+                cache->prefetcher->pc = refs[k].pc;
+                cache->prefetcher->has_pc = refs[k].has_pc;
+            }
+            if(refs[k].type == TRACE_WRITE)
+            {
+                writeAddress(cache, refs[k].address);
+            }
+            else if(refs[k].type == TRACE_INVALID)
+            {
+                count = -1;
+                break;
+            }
+            else
+            {
+                readAddress(cache, refs[k].address);
+            }
+            counter++;
+
+            if(pcs != NULL && refs[k].has_pc && !countPc(pcs, refs[k].pc, refs[k].type, (int)(cache->misses - misses), (int)(cache->writes - writes)))
+            {
+                count = -2;
+                break;
+            }
+
+            if(counter == stats->next && takeSnapshot(cache, stats, counter))
+            {
+                converged = 1;
+                break;
+            }
+        }
+        if(count < 0)
+        {
+            break;
+        }
     }
-    
-    index = (char *) malloc( sizeof(char) * (INDEX + 1) );
-    assert(index != NULL);
-    index[INDEX] = '\0';
-    
-    for(i = TAG + 1; i < INDEX + TAG + 1; i++)
+
+    traceInputClose(input);
+    if(count == -2)
     {
-        index[i - TAG - 1] = bformatted[i];
+        return -1;
     }
-    
-    offset = (char *) malloc( sizeof(char) * (OFFSET + 1) );
-    assert(offset != NULL);
-    offset[OFFSET] = '\0';
-    
-    for(i = INDEX + TAG + 2; i < OFFSET + INDEX + TAG + 2; i++)
+    if(count < 0)
     {
-        offset[i - INDEX - TAG - 2] = bformatted[i];
+        printf("%li: ERROR!!!!\n", counter);
+        return -1;
     }
-    
-    printf("Tag: %s (%i)\n", tag, btoi(tag));
-    printf("Index: %s (%i)\n", index, btoi(index));
-    printf("Offset: %s (%i)\n", offset, btoi(offset));
+    return counter;
 }
 
 int main(int argc, char **argv)
 {
     /* Local Variables */
-    int write_policy, counter, i, j;
+    int write_policy, i, arg, mapped, dialect, prefetch, degree;
+    long counter, cache_size, block_size, associativity, latency, victims, entries, cycles;
+    MapOptions options;
+    Snapshots stats;
+    PcTable pcs;
+    char *end, *statsPath;
     Cache cache;
-    FILE *file;
-    char mode, address[100];
-    
-    /* Technically a line shouldn't be longer than 25 characters, but
-       allocate extra space in the buffer just in case */
-    char buffer[LINELENGTH];
+    FILE *file, *raw;
     
     /* Help Menu
      *
@@ -206,17 +1684,174 @@ int main(int argc, char **argv)
     if(argc < 3 || strcmp(argv[1], "-h") == 0)
     {
         fprintf(stderr, 
-        "Usage: ./sim [-h] <write policy> <trace file>\n\n<write policy> is one of: \n\twt - simulate a write through cache. \n\twb - simulate a write back cache \n\n<trace file> is the name of a file that contains a memory access trace.\n");
+        "Usage: ./sim [-h] [-c <cache size>] [-b <block size>] [-a <associativity>] [-m] [-f <format>] [-j <threads>] [-i <interval>] [-r <first>[:<count>]] [-s <period>] [-o <stats file>] [-x <tolerance>] [-p <top>] [-P <prefetcher>[:<degree>]] [-l <latency>] [-v <lines>] [-w <entries>[:<cycles>]] <write policy> <trace file>\n\n");
+        fprintf(stderr,
+        "<cache size> and <block size> are in bytes and may end in k or m (default %i and %i).\n<associativity> is the number of ways per set (default %i).\n\n<write policy> is one of: \n\twt - simulate a write through cache. \n\twb - simulate a write back cache \n\n",
+        DEFAULT_CACHE_SIZE, DEFAULT_BLOCK_SIZE, DEFAULT_ASSOCIATIVITY);
+        fprintf(stderr,
+        "<trace file> is the name of a file that contains a memory access trace, as text or binary, optionally gzip or zstd compressed.\n<format> forces the trace format: drew, swift, cachesim, din or binary.\nIt is guessed from the first line otherwise.\n\n");
+        fprintf(stderr,
+        "-m memory maps the trace and reports the parse throughput.\n-j parses a mapped trace on <threads> threads.\n-i writes <trace file>.idx with the offset of every <interval>-th reference.\n-r simulates <count> references (default all) starting at reference <first>,\n   seeking with <trace file>.idx when it exists.\n\n");
+        fprintf(stderr,
+        "-s writes a snapshot of the counters every <period> references to\n   <stats file> (-o, default stdout), as JSON lines or CSV for a .csv file.\n-x stops once the interval miss ratio stays within <tolerance> of the\n   running miss ratio for %i snapshots in a row.\n-p lists the <top> PCs with the most misses, for traces that record PCs.\n\n",
+        CONVERGED_SNAPSHOTS);
+        fprintf(stderr,
+        "-P prefetches with next (next <degree> lines on a miss), stride (<degree>\n   strides ahead per PC) or stream (%i stream buffers of <degree> lines),\n   <degree> defaulting to %i. Prefetches arrive <latency> references after\n   they are issued (-l, default %i).\n",
+        STREAM_BUFFERS, DEFAULT_PREFETCH_DEGREE, DEFAULT_PREFETCH_LATENCY);
+        fprintf(stderr,
+        "-v adds a fully associative victim cache of <lines> lines.\n-w sends memory writes through a coalescing buffer of <entries> lines that\n   drains one line every <cycles> cycles (default %i), and counts the\n   cycles stalled on a full buffer. With 0 entries every write stalls.\n",
+        DEFAULT_WRITE_CYCLES);
+        return 0;
+    }
+    
+    /* Cache Geometry */
+    cache_size = DEFAULT_CACHE_SIZE;
+    block_size = DEFAULT_BLOCK_SIZE;
+    associativity = DEFAULT_ASSOCIATIVITY;
+    mapped = 0;
+    dialect = TRACE_DIALECT_UNKNOWN;
+    options.threads = 1;
+    options.interval = 0;
+    options.first = 0;
+    options.count = -1;
+    memset(&stats, 0, sizeof(stats));
+    stats.out = stdout;
+    stats.tolerance = -1;
+    statsPath = NULL;
+    memset(&pcs, 0, sizeof(pcs));
+    prefetch = PREFETCH_NONE;
+    degree = DEFAULT_PREFETCH_DEGREE;
+    latency = DEFAULT_PREFETCH_LATENCY;
+    victims = 0;
+    entries = -1;
+    cycles = DEFAULT_WRITE_CYCLES;
+    
+    for(arg = 1; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        if(strcmp(argv[arg], "-m") == 0)
+        {
+            mapped = 1;
+            arg--;
+            continue;
+        }
+        else if(strcmp(argv[arg], "-c") == 0)
+        {
+            cache_size = parseSize(argv[arg + 1]);
+        }
+        else if(strcmp(argv[arg], "-b") == 0)
+        {
+            block_size = parseSize(argv[arg + 1]);
+        }
+        else if(strcmp(argv[arg], "-a") == 0)
+        {
+            associativity = parseSize(argv[arg + 1]);
+        }
+        else if(strcmp(argv[arg], "-f") == 0)
+        {
+            dialect = traceDialectByName(argv[arg + 1]);
+            if(dialect == TRACE_DIALECT_UNKNOWN)
+            {
+                fprintf(stderr, "Unknown trace format %s.\n", argv[arg + 1]);
+                return 0;
+            }
+        }
+        else if(strcmp(argv[arg], "-j") == 0)
+        {
+            options.threads = (int)parseSize(argv[arg + 1]);
+            mapped = 1;
+        }
+        else if(strcmp(argv[arg], "-i") == 0)
+        {
+            options.interval = parseSize(argv[arg + 1]);
+            mapped = 1;
+        }
+        else if(strcmp(argv[arg], "-r") == 0)
+        {
+            options.first = strtol(argv[arg + 1], &end, 10);
+            if(*end == ':')
+            {
+                options.count = strtol(end + 1, &end, 10);
+            }
+            if(*end != '\0' || options.first < 0 || options.count < -1)
+            {
+                options.first = -1;
+            }
+            mapped = 1;
+        }
+        else if(strcmp(argv[arg], "-s") == 0)
+        {
+            stats.interval = parseSize(argv[arg + 1]);
+        }
+        else if(strcmp(argv[arg], "-p") == 0)
+        {
+            pcs.top = (int)parseSize(argv[arg + 1]);
+        }
+        else if(strcmp(argv[arg], "-P") == 0)
+        {
+            prefetch = parsePrefetcher(argv[arg + 1], &degree);
+        }
+        else if(strcmp(argv[arg], "-l") == 0)
+        {
+            latency = strtol(argv[arg + 1], &end, 10);
+            if(*end != '\0' || end == argv[arg + 1])
+            {
+                latency = -1;
+            }
+        }
+        else if(strcmp(argv[arg], "-v") == 0)
+        {
+            victims = parseSize(argv[arg + 1]);
+        }
+        else if(strcmp(argv[arg], "-w") == 0)
+        {
+            entries = strtol(argv[arg + 1], &end, 10);
+            if(*end == ':')
+            {
+                cycles = strtol(end + 1, &end, 10);
+            }
+            if(*end != '\0' || end == argv[arg + 1] || entries < 0 || entries > 4096 || cycles < 1)
+            {
+                cycles = -1;
+            }
+        }
+        else if(strcmp(argv[arg], "-o") == 0)
+        {
+            statsPath = argv[arg + 1];
+        }
+        else if(strcmp(argv[arg], "-x") == 0)
+        {
+            stats.tolerance = strtod(argv[arg + 1], &end);
+            if(*end != '\0' || end == argv[arg + 1] || stats.tolerance < 0)
+            {
+                stats.interval = -1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Invalid Option %s.\nUsage: ./sim [-h] [-c <cache size>] [-b <block size>] [-a <associativity>] [-m] [-f <format>] [-j <threads>] [-i <interval>] [-r <first>[:<count>]] [-s <period>] [-o <stats file>] [-x <tolerance>] [-p <top>] [-P <prefetcher>[:<degree>]] [-l <latency>] [-v <lines>] [-w <entries>[:<cycles>]] <write policy> <trace file>\n", argv[arg]);
+            return 0;
+        }
+        
+        if(cache_size < 0 || block_size < 0 || associativity < 0 || options.threads < 0 || options.interval < 0 || options.first < 0 || stats.interval < 0 || pcs.top < 0 || prefetch < 0 || latency < 0 || victims < 0 || victims > 4096 || cycles < 0)
+        {
+            fprintf(stderr, "Invalid value for %s: %s\n", argv[arg], argv[arg + 1]);
+            return 0;
+        }
+    }
+    
+    if(argc - arg < 2)
+    {
+        fprintf(stderr, "Usage: ./sim [-h] [-c <cache size>] [-b <block size>] [-a <associativity>] [-m] [-f <format>] [-j <threads>] [-i <interval>] [-r <first>[:<count>]] [-s <period>] [-o <stats file>] [-x <tolerance>] [-p <top>] [-P <prefetcher>[:<degree>]] [-l <latency>] [-v <lines>] [-w <entries>[:<cycles>]] <write policy> <trace file>\n");
         return 0;
     }
     
     /* Write Policy */
-    if(strcmp(argv[1], "wt") == 0)
+    if(strcmp(argv[arg], "wt") == 0)
     {
         write_policy = 0;
         if(DEBUG) printf("Write Policy: Write Through\n");
     }
-    else if(strcmp(argv[1], "wb") == 0)
+    else if(strcmp(argv[arg], "wb") == 0)
     {
         write_policy = 1;
         if(DEBUG) printf("Write Policy: Write Back\n");
@@ -227,79 +1862,174 @@ int main(int argc, char **argv)
         return 0;
     }
     
-    /* Open the file for reading. */
-    file = fopen( argv[2], "r" );
+    if(stats.tolerance >= 0 && stats.interval == 0)
+    {
+        fprintf(stderr, "Error: -x needs snapshots from -s.\n");
+        return 0;
+    }
+    
+    /* Build the cache. */
+    cache = createCache(cache_size, block_size, associativity, write_policy);
+    if(cache == NULL)
+    {
+        return 0;
+    }
+    
+    if((prefetch != PREFETCH_NONE && !attachPrefetcher(cache, prefetch, degree, latency)) || !attachBuffers(cache, victims, entries, cycles))
+    {
+        fprintf(stderr, "Error: Out of memory for the prefetcher or buffers.\n");
+        destroyCache(cache);
+        return 0;
+    }
+    
+    if(DEBUG) printf("Geometry: %i sets x %i ways x %i bytes (tag %i, index %i, offset %i bits)\n", cache->numSets, cache->associativity, cache->block_size, 64 - cache->index_bits - cache->offset_bits, cache->index_bits, cache->offset_bits);
+    
+    if(dialect == TRACE_DIALECT_UNKNOWN)
+    {
+        dialect = traceDialectByName(argv[arg + 1]);
+    }
+    
+    /* Open the file for reading. Compressed traces are inflated on the
+       fly by a second thread. */
+    raw = fopen( argv[arg + 1], "rb" );
+    file = (raw != NULL) ? traceDecompress(raw) : NULL;
     if( file == NULL )
     {
         fprintf(stderr, "Error: Could not open file.\n");
+        destroyCache(cache);
         return 0; 
     }
-
-    cache = createCache(CACHE_SIZE, BLOCK_SIZE, write_policy);
     
-    counter = 0;
+    if(mapped && file != raw)
+    {
+        if(options.interval > 0 || options.first > 0 || options.count >= 0)
+        {
+            fprintf(stderr, "Error: -i and -r need an uncompressed text trace.\n");
+            traceClose(file);
+            destroyCache(cache);
+            return 0;
+        }
+        fprintf(stderr, "Compressed traces cannot be memory mapped, ignoring -m.\n");
+        mapped = 0;
+    }
+    
+    /* Memory mapped text traces are parsed in place. Everything else,
+       binary traces included, goes through the shared trace reader. */
+    i = getc(file);
+    ungetc(i, file);
     
-    while( fgets(buffer, LINELENGTH, file) != NULL )
+    if(mapped && i == TRACE_MAGIC[0])
     {
-        if(buffer[0] != '#')
+        if(options.interval > 0 || options.first > 0 || options.count >= 0)
         {
-            i = 0;
-            while(buffer[i] != ' ')
-            {
-                i++;
-            }
-            
-            mode = buffer[i+1];
-            
-            i = i+2;
-            j = 0;
-            
-            while(buffer[i] != '\0')
-            {
-                address[j] = buffer[i];
-                i++;
-                j++;
-            }
-            
-            address[j-1] = '\0';
-            
-            if(DEBUG) printf("%i: %c %s\n", counter, mode, address);
-            
-            if(mode == 'R')
-            {
-                readFromCache(cache, address);
-            }
-            else if(mode == 'W')
-            {
-                writeToCache(cache, address);
-            }
-            else
+            fprintf(stderr, "Error: -i and -r need an uncompressed text trace.\n");
+            traceClose(file);
+            destroyCache(cache);
+            return 0;
+        }
+        mapped = 0;
+    }
+    
+    /* Interval snapshots */
+    stats.next = -1;
+    if(stats.interval > 0)
+    {
+        if(statsPath != NULL)
+        {
+            stats.out = fopen(statsPath, "w");
+            if(stats.out == NULL)
             {
-                printf("%i: ERROR!!!!\n", counter);
-                fclose(file);
+                fprintf(stderr, "Error: Could not create %s.\n", statsPath);
+                traceClose(file);
                 destroyCache(cache);
-                cache = NULL;
-                
                 return 0;
             }
-            counter++;
+            i = (int)strlen(statsPath);
+            stats.csv = i > 4 && strcmp(statsPath + i - 4, ".csv") == 0;
         }
+        if(stats.csv)
+        {
+            fprintf(stats.out, "refs,hits,misses,reads,writes,stall_cycles,coalesced_writes,miss_ratio,");
+            fprintf(stats.out, "interval_hits,interval_misses,interval_reads,interval_writes,interval_stall_cycles,interval_coalesced_writes,interval_miss_ratio\n");
+        }
+        stats.next = stats.interval;
     }
     
-    if(DEBUG) printf("Num Lines: %i\n", counter);
+    /* Per-PC counts */
+    if(pcs.top > 0)
+    {
+        pcs.capacity = PC_TABLE_START;
+        pcs.slots = (PcCount *) calloc(pcs.capacity, sizeof(PcCount));
+        if(pcs.slots == NULL)
+        {
+            fprintf(stderr, "Error: Out of memory for the PC table.\n");
+            traceClose(file);
+            destroyCache(cache);
+            return 0;
+        }
+    }
     
-    printf("CACHE HITS: %i\nCACHE MISSES: %i\nMEMORY READS: %i\nMEMORY WRITES: %i\n", cache->hits, cache->misses, cache->reads, cache->writes);
+    if(mapped)
+    {
+        counter = simulateMappedTrace(cache, argv[arg + 1], dialect, &options, &stats, pcs.top > 0 ? &pcs : NULL);
+    }
+    else
+    {
+        counter = simulateTrace(cache, file, dialect, &stats, pcs.top > 0 ? &pcs : NULL);
+    }
     
     /* Close the file, destroy the cache. */
     
-    fclose(file);
+    traceClose(file);
+    
+    /* Snapshot whatever the last full interval left over */
+    if(counter > stats.last && stats.interval > 0)
+    {
+        stats.tolerance = -1;
+        takeSnapshot(cache, &stats, counter);
+    }
+    if(stats.out != stdout && fclose(stats.out) != 0)
+    {
+        fprintf(stderr, "Error: Could not write %s.\n", statsPath);
+    }
+    
+    if(counter < 0)
+    {
+        free(pcs.slots);
+        destroyCache(cache);
+        return 0;
+    }
+    
+    if(DEBUG) printf("Num Lines: %li\n", counter);
+    
+    printf("CACHE HITS: %lu\nCACHE MISSES: %lu\nMEMORY READS: %lu\nMEMORY WRITES: %lu\n", (unsigned long)cache->hits, (unsigned long)cache->misses, (unsigned long)cache->reads, (unsigned long)cache->writes);
+    
+    if(cache->victims != NULL)
+    {
+        printf("VICTIM CACHE HITS: %li\n", cache->victims->hits);
+    }
+    if(cache->buffer != NULL)
+    {
+        printf("COALESCED WRITES: %li\nWRITE STALL CYCLES: %li\n", cache->buffer->coalesced, cache->buffer->stalls);
+    }
+    if(cache->prefetcher != NULL)
+    {
+        printPrefetches(cache);
+    }
+    
+    if(pcs.top > 0)
+    {
+        printTopPcs(&pcs);
+        free(pcs.slots);
+    }
+    
     destroyCache(cache);
     cache = NULL;
     
     return 1;
 }
 
-Cache createCache(int cache_size, int block_size, int write_policy)
+Cache createCache(long cache_size, long block_size, long associativity, int write_policy)
 {
     /* Local Variables */
     Cache cache;
@@ -318,6 +2048,36 @@ Cache createCache(int cache_size, int block_size, int write_policy)
         return NULL;
     }
     
+    if(associativity <= 0)
+    {
+        fprintf(stderr, "Associativity must be at least 1 way...\n");
+        return NULL;
+    }
+    
+    if(!isPowerOfTwo(cache_size) || !isPowerOfTwo(block_size) || !isPowerOfTwo(associativity))
+    {
+        fprintf(stderr, "Cache size, block size and associativity must be powers of 2...\n");
+        return NULL;
+    }
+    
+    if(block_size * associativity > cache_size)
+    {
+        fprintf(stderr, "Cache of %li bytes cannot hold %li ways of %li byte blocks...\n", cache_size, associativity, block_size);
+        return NULL;
+    }
+    
+    if(cache_size / block_size > 0x7fffffffL)
+    {
+        fprintf(stderr, "Cache of %li bytes has too many lines...\n", cache_size);
+        return NULL;
+    }
+    
+    if(associativity > 65536)
+    {
+        fprintf(stderr, "Associativity must be at most 65536 ways...\n");
+        return NULL;
+    }
+    
     if(write_policy != 0 && write_policy != 1)
     {
         fprintf(stderr, "Write policy must be either \"Write Through\" or \"Write Back\".\n");
@@ -339,23 +2099,40 @@ Cache createCache(int cache_size, int block_size, int write_policy)
     
     cache->write_policy = write_policy;
     
-    cache->cache_size = CACHE_SIZE;
-    cache->block_size = BLOCK_SIZE;
-    
-    /* Calculate numLines */
-    cache->numLines = (int)(CACHE_SIZE / BLOCK_SIZE);
-    
-    cache->blocks = (Block*) malloc( sizeof(Block) * cache->numLines );
-    assert(cache->blocks != NULL);
-        
-    /* By default insert blocks where valid = 0 */
-    for(i = 0; i < cache->numLines; i++)
+    cache->cache_size = (int)cache_size;
+    cache->block_size = (int)block_size;
+    
+    /* Calculate numLines and numSets */
+    cache->numLines = (int)(cache_size / block_size);
+    cache->associativity = (int)associativity;
+    cache->numSets = cache->numLines / cache->associativity;
+    
+    /* Derive the address fields from the geometry */
+    cache->offset_bits = log2i(block_size);
+    cache->index_bits = log2i(cache->numSets);
+    cache->offset_mask = (1u << cache->offset_bits) - 1;
+    cache->index_mask = (1u << cache->index_bits) - 1;
+    
+    /* By default every line is invalid and clean */
+    cache->tags = (unsigned int*) calloc( cache->numLines, sizeof(unsigned int) );
+    cache->wide_tags = NULL;
+    cache->valid = (unsigned long*) calloc( BITSET_WORDS(cache->numLines), sizeof(unsigned long) );
+    cache->dirty = (unsigned long*) calloc( BITSET_WORDS(cache->numLines), sizeof(unsigned long) );
+    assert(cache->tags != NULL && cache->valid != NULL && cache->dirty != NULL);
+    
+    cache->lru = NULL;
+    cache->prefetcher = NULL;
+    cache->victims = NULL;
+    cache->buffer = NULL;
+    if(cache->associativity > 1)
     {
-        cache->blocks[i] = (Block) malloc( sizeof( struct Block_ ) );
-        assert(cache->blocks[i] != NULL);
-        cache->blocks[i]->valid = 0;
-        cache->blocks[i]->dirty = 0;
-        cache->blocks[i]->tag = NULL;
+        cache->lru = (unsigned short*) malloc( sizeof(unsigned short) * cache->numLines );
+        assert(cache->lru != NULL);
+        
+        for(i = 0; i < cache->numLines; i++)
+        {
+            cache->lru[i] = (unsigned short)(i % cache->associativity);
+        }
     }
     
     return cache;
@@ -367,16 +2144,34 @@ void destroyCache(Cache cache)
     
     if(cache != NULL)
     {
-        for( i = 0; i < cache->numLines; i++ )
+        if(cache->prefetcher != NULL)
         {
-            if(cache->blocks[i]->tag != NULL)
+            for(i = 0; i < STREAM_BUFFERS; i++)
             {
-                free(cache->blocks[i]->tag);
+                free(cache->prefetcher->buffers[i].ready);
             }
-            
-            free(cache->blocks[i]);
+            free(cache->prefetcher->prefetched);
+            free(cache->prefetcher->ready);
+            free(cache->prefetcher->table);
+            free(cache->prefetcher);
+        }
+        if(cache->victims != NULL)
+        {
+            free(cache->victims->lines);
+            free(cache->victims->dirty);
+            free(cache->victims);
         }
-        free(cache->blocks);
+        if(cache->buffer != NULL)
+        {
+            free(cache->buffer->lines);
+            free(cache->buffer->done);
+            free(cache->buffer);
+        }
+        free(cache->tags);
+        free(cache->wide_tags);
+        free(cache->valid);
+        free(cache->dirty);
+        free(cache->lru);
         free(cache);
     }
     return;
@@ -384,12 +2179,6 @@ void destroyCache(Cache cache)
 
 int readFromCache(Cache cache, char* address)
 {
-    unsigned int dec;
-    char *bstring, *bformatted, *tag, *index, *offset;
-    int i;
-    Block block;
-    
-    
     /* Validate inputs */
     if(cache == NULL)
     {
@@ -403,107 +2192,72 @@ int readFromCache(Cache cache, char* address)
         return 0;
     }
     
-    /* Convert and parse necessary values */
-    
-    dec = htoi(address);
-    bstring = getBinary(dec);
-    bformatted = formatBinary(bstring);
-    
     if(DEBUG)
     {
         printf("Hex: %s\n", address);
-        printf("Decimal: %u\n", dec);
-        printf("Binary: %s\n", bstring);
-        printf("Formatted: %s\n", bformatted);
-    }
-        
-    i = 0;
-    
-    tag = (char *) malloc( sizeof(char) * (TAG + 1) );
-    assert(tag != NULL);
-    tag[TAG] = '\0';
-    
-    for(i = 0; i < TAG; i++)
-    {
-        tag[i] = bformatted[i];
-    }
-    
-    index = (char *) malloc( sizeof(char) * (INDEX + 1) );
-    assert(index != NULL);
-    index[INDEX] = '\0';
-    
-    for(i = TAG + 1; i < INDEX + TAG + 1; i++)
-    {
-        index[i - TAG - 1] = bformatted[i];
     }
     
-    offset = (char *) malloc( sizeof(char) * (OFFSET + 1) );
-    assert(offset != NULL);
-    offset[OFFSET] = '\0';
+    return readAddress(cache, htoi(address));
+}
+
+int readAddress(Cache cache, uint64_t address)
+{
+    uint64_t tag;
+    unsigned int index, offset;
+    unsigned int line;
+    int hit, dirty;
     
-    for(i = INDEX + TAG + 2; i < OFFSET + INDEX + TAG + 2; i++)
-    {
-        offset[i - INDEX - TAG - 2] = bformatted[i];
-    }
+    splitAddress(cache, address, &tag, &index, &offset);
     
     if(DEBUG)
     {
-        printf("Tag: %s (%i)\n", tag, btoi(tag));
-        printf("Index: %s (%i)\n", index, btoi(index));
-        printf("Offset: %s (%i)\n", offset, btoi(offset));
+        printf("Decimal: %lu\n", (unsigned long)address);
+        printf("Tag: %lu\nIndex: %u\nOffset: %u\n", (unsigned long)tag, index, offset);
+        printf("Attempting to read data from cache set %u.\n", index);
     }
     
-    /* Get the block */
+    /* Get the line */
     
-    block = cache->blocks[btoi(index)];
-    
-    if(DEBUG)
-    {
-        printf("Attempting to read data from cache slot %i.\n", btoi(index));
-    }
+    line = findLine(cache, tag, index, &hit);
     
-    if(block->valid == 1 && strcmp(block->tag, tag) == 0)
+    if(hit)
     {
         cache->hits++;
-        free(tag);
     }
     else
     {        
-        cache->misses++;
-        cache->reads++;
-        
-        if(cache->write_policy == 1 && block->dirty == 1)
+        dirty = 0;
+        if((cache->victims != NULL && victimCovers(cache, address, &dirty)) ||
+           (cache->prefetcher != NULL && prefetchCovers(cache, address)))
         {
-            cache->writes++;
-            block->dirty = 0;
+            cache->hits++;
+        }
+        else
+        {
+            cache->misses++;
+            cache->reads++;
         }
         
-        block->valid = 1;
-        
-        if(block->tag != NULL)
+        evictLine(cache, line, index);
+        if(dirty)
         {
-            free(block->tag);
+            BIT_SET(cache->dirty, line);
         }
         
-        block->tag = tag;
+        BIT_SET(cache->valid, line);
+        setLineTag(cache, line, tag);
     }
     
+    if(cache->prefetcher != NULL)
+    {
+        prefetchTrain(cache, address, line, hit);
+    }
     
-    free(bstring);
-    free(bformatted);
-    free(offset);
-    free(index);
     return 1;
 }
 
 int writeToCache(Cache cache, char* address)
 {
-    unsigned int dec;
-    char *bstring, *bformatted, *tag, *index, *offset;
-    int i;
-    Block block;
-    
-    
     /* Validate inputs */
     if(cache == NULL)
     {
@@ -517,126 +2271,87 @@ int writeToCache(Cache cache, char* address)
         return 0;
     }
     
-    /* Convert and parse necessary values */
-    
-    dec = htoi(address);
-    bstring = getBinary(dec);
-    bformatted = formatBinary(bstring);
-    
     if(DEBUG)
     {
         printf("Hex: %s\n", address);
-        printf("Decimal: %u\n", dec);
-        printf("Binary: %s\n", bstring);
-        printf("Formatted: %s\n", bformatted);
-    }
-        
-    i = 0;
-    
-    tag = (char *) malloc( sizeof(char) * (TAG + 1) );
-    assert(tag != NULL);
-    tag[TAG] = '\0';
-    
-    for(i = 0; i < TAG; i++)
-    {
-        tag[i] = bformatted[i];
-    }
-    
-    index = (char *) malloc( sizeof(char) * (INDEX + 1) );
-    assert(index != NULL);
-    index[INDEX] = '\0';
-    
-    for(i = TAG + 1; i < INDEX + TAG + 1; i++)
-    {
-        index[i - TAG - 1] = bformatted[i];
     }
     
-    offset = (char *) malloc( sizeof(char) * (OFFSET + 1) );
-    assert(offset != NULL);
-    offset[OFFSET] = '\0';
+    return writeAddress(cache, htoi(address));
+}
+
+int writeAddress(Cache cache, uint64_t address)
+{
+    uint64_t tag;
+    unsigned int index, offset;
+    unsigned int line;
+    int hit, dirty;
     
-    for(i = INDEX + TAG + 2; i < OFFSET + INDEX + TAG + 2; i++)
-    {
-        offset[i - INDEX - TAG - 2] = bformatted[i];
-    }
+    splitAddress(cache, address, &tag, &index, &offset);
     
     if(DEBUG)
     {
-        printf("Tag: %s (%i)\n", tag, btoi(tag));
-        printf("Index: %s (%i)\n", index, btoi(index));
-        printf("Offset: %s (%i)\n", offset, btoi(offset));
+        printf("Decimal: %lu\n", (unsigned long)address);
+        printf("Tag: %lu\nIndex: %u\nOffset: %u\n", (unsigned long)tag, index, offset);
+        printf("Attempting to write data to cache set %u.\n", index);
     }
     
-    /* Get the block */
+    /* Get the line */
     
-    block = cache->blocks[btoi(index)];
-    
-    if(DEBUG)
-    {
-        printf("Attempting to write data to cache slot %i.\n", btoi(index));
-    }
+    line = findLine(cache, tag, index, &hit);
     
-    if(block->valid == 1 && strcmp(block->tag, tag) == 0)
+    if(hit)
     {
+        cache->hits++;
         if(cache->write_policy == 0)
         {
-            cache->writes++;
+            memoryWrite(cache, address >> cache->offset_bits);
         }
-        block->dirty = 1;
-        cache->hits++;
-        free(tag);
+        BIT_SET(cache->dirty, line);
     }
     else
     {
-        cache->misses++;
-        cache->reads++;
-        
-        if(cache->write_policy == 0)
+        if((cache->victims != NULL && victimCovers(cache, address, &dirty)) ||
+           (cache->prefetcher != NULL && prefetchCovers(cache, address)))
         {
-            cache->writes++;
+            cache->hits++;
         }
-        
-        if(cache->write_policy == 1 && block->dirty == 1)
+        else
         {
-            cache->writes++;
-        }        
-        
-        block->dirty = 1;
-        
-        block->valid = 1;
+            cache->misses++;
+            cache->reads++;
+        }
         
-        if(block->tag != NULL)
+        if(cache->write_policy == 0)
         {
-            free(block->tag);
+            memoryWrite(cache, address >> cache->offset_bits);
         }
         
-        block->tag = tag;
+        evictLine(cache, line, index);
+        
+        BIT_SET(cache->dirty, line);
+        
+        BIT_SET(cache->valid, line);
+        setLineTag(cache, line, tag);
+    }
+    
+    if(cache->prefetcher != NULL)
+    {
+        prefetchTrain(cache, address, line, hit);
     }
     
-    free(bstring);
-    free(bformatted);
-    free(offset);
-    free(index);
     return 1;
 }
 
 void printCache(Cache cache)
 {
     int i;
-    char* tag;
     
     if(cache != NULL)
     {        
         for(i = 0; i < cache->numLines; i++)
         {
-            tag = "NULL";
-            if(cache->blocks[i]->tag != NULL)
-            {
-                tag = cache->blocks[i]->tag;
-            }
-            
-            printf("[%i]: { valid: %i, tag: %s }\n", i, cache->blocks[i]->valid, tag);
+            printf("[%i]: { valid: %i, tag: 0x%lx }\n", i, (int)BIT_TEST(cache->valid, i), (unsigned long)lineTag(cache, i));
         }
-        printf("Cache:\n\tCACHE HITS: %i\n\tCACHE MISSES: %i\n\tMEMORY READS: %i\n\tMEMORY WRITES: %i\n\n\tCACHE SIZE: %i Bytes\n\tBLOCK SIZE: %i Bytes\n\tNUM LINES: %i\n", cache->hits, cache->misses, cache->reads, cache->writes, cache->cache_size, cache->block_size, cache->numLines);
+        printf("Cache:\n\tCACHE HITS: %lu\n\tCACHE MISSES: %lu\n\tMEMORY READS: %lu\n\tMEMORY WRITES: %lu\n\n\tCACHE SIZE: %i Bytes\n\tBLOCK SIZE: %i Bytes\n\tNUM LINES: %i\n\tASSOCIATIVITY: %i\n\tNUM SETS: %i\n", (unsigned long)cache->hits, (unsigned long)cache->misses, (unsigned long)cache->reads, (unsigned long)cache->writes, cache->cache_size, cache->block_size, cache->numLines, cache->associativity, cache->numSets);
     }
 }
\ No newline at end of file
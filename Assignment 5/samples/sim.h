@@ -7,24 +7,88 @@
  * This is a program that simulates a cache using a trace file 
  * and either a write through or write back policy.
  * 
- * Usage: Usage: ./sim [-h] <write policy> <trace file>
+ * Usage: Usage: ./sim [-h] [-c <cache size>] [-b <block size>]
+ *                     [-a <associativity>] [-m] [-f <format>] [-j <threads>]
+ *                     [-i <interval>] [-r <first>[:<count>]]
+ *                     [-s <period>] [-o <stats file>] [-x <tolerance>]
+ *                     [-p <top>] [-P <prefetcher>[:<degree>]] [-l <latency>]
+ *                     [-v <lines>] [-w <entries>[:<cycles>]]
+ *                     <write policy> <trace file>
+ *
+ * <cache size> and <block size> are in bytes and may end in k or m.
+ * <associativity> is the number of ways in each set. All three must be
+ * powers of 2.
+ *
+ * -m memory maps the trace file and parses it in place instead of reading
+ * it line by line, then reports the parse throughput in MB/s. -j, -i and
+ * -r imply -m:
+ *
+ * -j parses the mapped trace in newline aligned chunks on <threads>
+ * threads. Chunks are still simulated in file order.
+ *
+ * -i writes a sidecar index, <trace file>.idx, with the offset of every
+ * <interval>-th reference (see ../trace/trace.h).
+ *
+ * -r simulates only <count> references (default: the rest of the trace)
+ * starting at reference <first>, counting from 0. If <trace file>.idx
+ * matches the trace, parsing starts at the closest indexed reference
+ * instead of the top of the file.
+ *
+ * -s writes the hit, miss, read and write counters every <period>
+ * references, both running totals and per interval, to <stats file>
+ * (default stdout). Snapshots are JSON lines, or CSV if <stats file> ends
+ * in .csv. -x stops the run early once the interval miss ratio stays
+ * within <tolerance> of the running one for a few snapshots in a row.
+ *
+ * -p counts reads, writes, hits, misses and memory writes per instruction
+ * PC, for traces that record one (swift, or binary converted from it),
+ * and lists the <top> PCs with the most misses after the totals.
+ *
+ * -P attaches a prefetcher, one of:
+ *      next    fetch the next <degree> lines on a miss
+ *      stride  fetch up to <degree> strides ahead of each PC once its
+ *              stride repeats (needs a trace with PCs)
+ *      stream  keep 4 stream buffers of <degree> sequential lines
+ * and reports useful, late and useless prefetches, accuracy, coverage and
+ * the extra memory reads. -l sets how many references a prefetch takes
+ * to arrive; one used before then is late.
+ *
+ * -v puts a fully associative victim cache of <lines> lines behind the
+ * cache. Evicted lines wait there, misses that find their line there
+ * swap it back without a memory read, and only dirty lines leaving it
+ * are written back.
+ *
+ * -w sends memory writes through a coalescing write buffer of <entries>
+ * lines that drains one line every <cycles> cycles, merging writes to a
+ * line still waiting in it. The clock advances one cycle per reference,
+ * and the cycles stalled waiting on a full buffer are reported. With 0
+ * entries every memory write stalls for <cycles>.
  *
  * <write policy> is one of:
  *      wt - simulate a write through cache.
  *      wb - simulate a write back cache
  *
- * <trace file> is the name of a file that contains a memory access trace.
+ * <trace file> is the name of a file that contains a memory access trace,
+ * in any of the text dialects or the binary format from ../trace/trace.h,
+ * and optionally gzip or zstd compressed. The format is guessed from the
+ * first line unless forced with -f <format>: drew, swift, cachesim, din
+ * or binary.
  */
  
 #ifndef SWIFT_SIM_H_
 #define SWIFT_SIM_H_
 
+#include <stdint.h>
+
 /* Constants 
  *
- * Both CACHE_SIZE and BLOCK_SIZE are in bytes. We can calculate the number 
- * of lines in the cache with CACHE_SIZE / BLOCK_SIZE.
+ * Both DEFAULT_CACHE_SIZE and DEFAULT_BLOCK_SIZE are in bytes. We can
+ * calculate the number of lines in the cache with cache size / block size,
+ * and the number of sets with lines / associativity.
  * 
  * Ex. 16kb / 4 Bytes = 4096 Lines
+ *
+ * The tag, index and offset widths are derived from these at startup.
  */
 
 /* Print Debug Messages */
@@ -33,35 +97,44 @@
 /* Max Line Length in Trace */
 #define LINELENGTH 128
 
-/* Cache Sizes (in bytes) */
-#define CACHE_SIZE 16384
-#define BLOCK_SIZE 4
+/* Default Cache Sizes (in bytes), overridden with -c and -b */
+#define DEFAULT_CACHE_SIZE 16384
+#define DEFAULT_BLOCK_SIZE 4
+
+/* Default Ways per Set, overridden with -a (1 = direct mapped) */
+#define DEFAULT_ASSOCIATIVITY 1
 
-/* Block Sizes */
-#define TAG 18 /* 18 + 0 = 18 */
-#define INDEX 12 /* 18 + 12 = 30 */
-#define OFFSET 2 /* 30 + 2 = 32 */
+/* Default Prefetch Degree and Latency (in references), overridden with
+ * -P <prefetcher>:<degree> and -l */
+#define DEFAULT_PREFETCH_DEGREE 2
+#define DEFAULT_PREFETCH_LATENCY 20
+
+/* Default Cycles to Drain One Line from the Write Buffer, overridden
+ * with -w <entries>:<cycles> */
+#define DEFAULT_WRITE_CYCLES 10
 
 
 /* Typedefs */
 typedef struct Cache_* Cache;
-typedef struct Block_* Block;
 
 
 /* createCache
  *
  * Function to create a new cache struct.  Returns the new struct on success
- * and NULL on failure.
+ * and NULL on failure. The sizes must be powers of 2 and the cache must
+ * hold at least one full set. Blocks in a set are replaced least
+ * recently used first.
  *
  * @param   cache_size      size of cache in bytes
  * @param   block_size      size of each block in bytes
+ * @param   associativity   number of blocks in each set
  * @param   write_policy    0 = write through, 1 = write back
  *
  * @return  success         new Cache
  * @return  failure         NULL
  */
  
-Cache createCache(int cache_size, int block_size, int write_policy);
+Cache createCache(long cache_size, long block_size, long associativity, int write_policy);
 
 /* destroyCache
  * 
@@ -90,10 +163,25 @@ void destroyCache(Cache cache);
 
 int readFromCache(Cache cache, char* address);
 
+/* readAddress
+ *
+ * Same as readFromCache, but takes an address that has already been
+ * converted to an integer. Splits it into tag, index and offset with
+ * shifts and masks, so no memory is allocated per reference. Addresses
+ * are 64 bits; tags are stored in 32 bits until one needs more.
+ *
+ * @param       cache       target cache struct
+ * @param       address     memory address
+ *
+ * @return      success     1
+ */
+
+int readAddress(Cache cache, uint64_t address);
+
 /* writeToCache
  *
  * Function that writes data to the cache. Returns 0 on failure or
- * 1 on success. Frees any old tags that already existed in the
+ * 1 on success. Overwrites any old tag that already existed in the
  * target slot.
  *
  * @param       cache       target cache struct
@@ -105,6 +193,19 @@ int readFromCache(Cache cache, char* address);
 
 int writeToCache(Cache cache, char* address);
 
+/* writeAddress
+ *
+ * Same as writeToCache, but takes an address that has already been
+ * converted to an integer.
+ *
+ * @param       cache       target cache struct
+ * @param       address     memory address
+ *
+ * @return      success     1
+ */
+
+int writeAddress(Cache cache, uint64_t address);
+
 /* printCache
  *
  * Prints out the values of each slot in the cache
@@ -0,0 +1,1069 @@
+/* File: trace.c
+ *
+ * Text dialect parser, encoder and decoder for the binary trace format
+ * described in trace.h, plus streaming decompression of gzip and zstd
+ * traces.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "trace.h"
+
+#define REC_TYPE_MASK 0x03
+#define REC_SIZE_SHIFT 2
+#define REC_SIZE_MASK 0x0c
+#define REC_HAS_PC 0x10
+#define REC_SAME_STRIDE 0x20
+
+struct TraceWriter_ {
+    FILE *out;
+    long header_pos;
+    uint64_t count;
+    uint64_t last_address;
+    uint64_t last_pc;
+    int64_t last_delta;
+};
+
+/* First bytes of the compressed formats. No text dialect starts with
+   either, and the binary format starts with 'C'. */
+#define GZIP_MAGIC 0x1f
+#define ZSTD_MAGIC 0x28
+
+#define STREAM_CHUNK 65536
+
+enum { FORMAT_GZIP, FORMAT_ZSTD };
+
+typedef struct TraceStream_ {
+    FILE *in;                       /* compressed source */
+    FILE *out;                      /* decompressed stream given out */
+    int fd;                         /* writing end of the socket pair */
+    int format;
+    pthread_t thread;
+    struct TraceStream_ *next;
+} TraceStream;
+
+static TraceStream *streams = NULL;
+static pthread_mutex_t streamsLock = PTHREAD_MUTEX_INITIALIZER;
+
+struct TraceReader_ {
+    FILE *in;
+    uint64_t count;
+    uint64_t last_address;
+    uint64_t last_pc;
+    int64_t last_delta;
+};
+
+#define INPUT_BUFFER (1024 * 1024)
+
+struct TraceInput_ {
+    FILE *in;
+    int dialect;
+    int failed;
+    TraceReader reader;     /* binary traces only */
+    char *buffer;           /* text traces only */
+    size_t start;           /* first unparsed byte */
+    size_t complete;        /* end of the last whole line */
+    size_t length;          /* bytes in the buffer */
+    int eof;
+};
+
+const char *traceDialectNames[TRACE_DIALECTS] = { "unknown", "drew", "swift", "cachesim", "din", "binary" };
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static void putVarint(FILE *out, uint64_t value)
+{
+    while(value >= 0x80)
+    {
+        putc((int)(value & 0x7f) | 0x80, out);
+        value >>= 7;
+    }
+    putc((int)value, out);
+}
+
+static int getVarint(FILE *in, uint64_t *value)
+{
+    uint64_t result;
+    int shift, c;
+
+    result = 0;
+    for(shift = 0; shift < 64; shift += 7)
+    {
+        c = getc(in);
+        if(c == EOF)
+        {
+            return 0;
+        }
+        result |= (uint64_t)(c & 0x7f) << shift;
+        if((c & 0x80) == 0)
+        {
+            *value = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void putLE64(unsigned char *buffer, uint64_t value)
+{
+    int i;
+
+    for(i = 0; i < 8; i++)
+    {
+        buffer[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint64_t getLE64(const unsigned char *buffer)
+{
+    uint64_t value;
+    int i;
+
+    value = 0;
+    for(i = 7; i >= 0; i--)
+    {
+        value = (value << 8) | buffer[i];
+    }
+    return value;
+}
+
+static const char *skipBlanks(const char *p, const char *end)
+{
+    while(p < end && (*p == ' ' || *p == '\t'))
+    {
+        p++;
+    }
+    return p;
+}
+
+/* parseHex
+ *
+ * Parses a hex number with an optional 0x prefix. Returns the first
+ * character after it, or NULL if there are no digits.
+ */
+
+static const char *parseHex(const char *p, const char *end, uint64_t *value)
+{
+    const char *digits;
+    uint64_t result;
+    int c;
+
+    if(end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    {
+        p += 2;
+    }
+
+    result = 0;
+    for(digits = p; p < end; p++)
+    {
+        c = (unsigned char)*p;
+        if(c >= '0' && c <= '9')
+        {
+            c -= '0';
+        }
+        else if((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+        {
+            c = (c | 0x20) - 'a' + 10;
+        }
+        else
+        {
+            break;
+        }
+        result = (result << 4) | (uint64_t)c;
+    }
+
+    *value = result;
+    return (p == digits) ? NULL : p;
+}
+
+/* parseCycle
+ *
+ * Parses a decimal cycle count. Returns the first character after it,
+ * or NULL if there are no digits.
+ */
+
+static const char *parseCycle(const char *p, const char *end, uint64_t *value)
+{
+    const char *digits;
+    uint64_t result;
+
+    result = 0;
+    for(digits = p; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+        result = result * 10 + (uint64_t)(*p - '0');
+    }
+
+    *value = result;
+    return (p == digits) ? NULL : p;
+}
+
+static const char *parseDecimal(const char *p, const char *end, int *value)
+{
+    const char *digits;
+    int result;
+
+    result = 0;
+    for(digits = p; p < end && *p >= '0' && *p <= '9' && result < 100000000; p++)
+    {
+        result = result * 10 + (*p - '0');
+    }
+
+    *value = result;
+    return (p == digits) ? NULL : p;
+}
+
+int traceDialectByName(const char *name)
+{
+    size_t length;
+    int dialect;
+
+    for(dialect = TRACE_DREW; dialect < TRACE_DIALECTS; dialect++)
+    {
+        if(strcmp(name, traceDialectNames[dialect]) == 0)
+        {
+            return dialect;
+        }
+    }
+
+    length = strlen(name);
+    if(length > 4 && strcmp(name + length - 4, ".din") == 0)
+    {
+        return TRACE_DIN;
+    }
+    return TRACE_DIALECT_UNKNOWN;
+}
+
+int traceParseLine(int dialect, const char **pos, const char *end, TraceRef *ref)
+{
+    const char *p, *q, *line_end;
+    int number;
+
+    p = *pos;
+    line_end = (const char *) memchr(p, '\n', (size_t)(end - p));
+    if(line_end == NULL)
+    {
+        line_end = end;
+    }
+    *pos = (line_end < end) ? line_end + 1 : end;
+
+    p = skipBlanks(p, line_end);
+    if(p == line_end || *p == '#' || *p == '\r')
+    {
+        return 0;
+    }
+
+    memset(ref, 0, sizeof(*ref));
+    ref->type = TRACE_INVALID;
+    ref->size = 4;
+
+    switch(dialect)
+    {
+        case TRACE_DREW:
+            if(line_end - p < 2 || (p[0] != 'R' && p[0] != 'W') || p[1] != ':')
+            {
+                break;
+            }
+            /* Odd sizes are passed on for the simulator to reject */
+            q = parseDecimal(p + 2, line_end, &number);
+            if(q == NULL || q == line_end || *q != ':' || number > 255)
+            {
+                break;
+            }
+            if(parseHex(q + 1, line_end, &ref->address) != NULL)
+            {
+                ref->type = (p[0] == 'W') ? TRACE_WRITE : TRACE_READ;
+                ref->size = (unsigned char)number;
+            }
+            break;
+
+        case TRACE_SWIFT:
+            q = parseHex(p, line_end, &ref->pc);
+            if(q == NULL || q == line_end || *q != ':')
+            {
+                break;
+            }
+            q = skipBlanks(q + 1, line_end);
+            if(q == line_end || (*q != 'R' && *q != 'W'))
+            {
+                break;
+            }
+            if(parseHex(skipBlanks(q + 1, line_end), line_end, &ref->address) != NULL)
+            {
+                ref->type = (*q == 'W') ? TRACE_WRITE : TRACE_READ;
+                ref->has_pc = 1;
+            }
+            break;
+
+        case TRACE_CACHESIM:
+        case TRACE_DIN:
+            q = parseDecimal(p, line_end, &number);
+            if(q == NULL || q == line_end || (*q != ' ' && *q != '\t'))
+            {
+                break;
+            }
+            q = parseHex(skipBlanks(q, line_end), line_end, &ref->address);
+            if(q == NULL)
+            {
+                break;
+            }
+            if(dialect == TRACE_CACHESIM && number <= 2)
+            {
+                ref->type = (number == 0) ? TRACE_IFETCH : (number == 1) ? TRACE_READ : TRACE_WRITE;
+                /* Optional cycle to issue the reference at */
+                p = skipBlanks(q, line_end);
+                if(p > q && parseCycle(p, line_end, &ref->time) != NULL)
+                {
+                    ref->has_time = 1;
+                }
+            }
+            else if(dialect == TRACE_DIN && number <= 2)
+            {
+                ref->type = (number == 0) ? TRACE_READ : (number == 1) ? TRACE_WRITE : TRACE_IFETCH;
+            }
+            else if(dialect == TRACE_DIN && number <= 4)
+            {
+                /* Dinero escape records carry no access */
+                return 0;
+            }
+            break;
+    }
+    return 1;
+}
+
+int traceGuessDialect(const char *data, const char *end)
+{
+    const char *line, *p;
+    TraceRef ref;
+    int dialect;
+
+    while(data < end)
+    {
+        line = data;
+        if(traceParseLine(TRACE_DREW, &data, end, &ref) == 0)
+        {
+            continue;
+        }
+        for(dialect = TRACE_DREW; dialect <= TRACE_CACHESIM; dialect++)
+        {
+            p = line;
+            if(traceParseLine(dialect, &p, end, &ref) == 1 && ref.type != TRACE_INVALID)
+            {
+                return dialect;
+            }
+        }
+        break;
+    }
+    return TRACE_DIALECT_UNKNOWN;
+}
+
+int traceIsBinary(const unsigned char *data, size_t length)
+{
+    return length >= 4 && memcmp(data, TRACE_MAGIC, 4) == 0;
+}
+
+TraceWriter traceWriterOpen(FILE *out, int flags)
+{
+    TraceWriter writer;
+    unsigned char header[TRACE_HEADER_SIZE];
+
+    writer = (TraceWriter) calloc(1, sizeof(struct TraceWriter_));
+    if(writer == NULL)
+    {
+        return NULL;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, TRACE_MAGIC, 4);
+    header[4] = TRACE_VERSION;
+    header[5] = (unsigned char)flags;
+
+    writer->out = out;
+    writer->header_pos = ftell(out);
+    if(fwrite(header, 1, sizeof(header), out) != sizeof(header))
+    {
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+int traceWrite(TraceWriter writer, const TraceRef *ref)
+{
+    int64_t delta;
+    int tag, log_size;
+
+    log_size = 0;
+    while((1 << log_size) < ref->size && log_size < 3)
+    {
+        log_size++;
+    }
+
+    /* Deltas wrap modulo 2^64, so any two addresses are a delta apart */
+    delta = (int64_t)(ref->address - writer->last_address);
+    tag = (ref->type & REC_TYPE_MASK) | (log_size << REC_SIZE_SHIFT);
+    if(ref->has_pc)
+    {
+        tag |= REC_HAS_PC;
+    }
+    if(delta == writer->last_delta && writer->count > 0)
+    {
+        tag |= REC_SAME_STRIDE;
+    }
+
+    putc(tag, writer->out);
+    if(!(tag & REC_SAME_STRIDE))
+    {
+        putVarint(writer->out, zigzag(delta));
+    }
+    if(ref->has_pc)
+    {
+        putVarint(writer->out, zigzag((int64_t)(ref->pc - writer->last_pc)));
+        writer->last_pc = ref->pc;
+    }
+
+    writer->last_address = ref->address;
+    writer->last_delta = delta;
+    writer->count++;
+    return !ferror(writer->out);
+}
+
+uint64_t traceWriterClose(TraceWriter writer)
+{
+    unsigned char count[8];
+    uint64_t written;
+    long end;
+
+    written = writer->count;
+    fflush(writer->out);
+
+    /* Patch the record count in if we can seek back to the header */
+    end = ftell(writer->out);
+    if(writer->header_pos >= 0 && end >= 0 && fseek(writer->out, writer->header_pos + 8, SEEK_SET) == 0)
+    {
+        putLE64(count, written);
+        fwrite(count, 1, sizeof(count), writer->out);
+        fseek(writer->out, end, SEEK_SET);
+        fflush(writer->out);
+    }
+
+    free(writer);
+    return written;
+}
+
+TraceReader traceReaderOpen(FILE *in)
+{
+    TraceReader reader;
+    unsigned char header[TRACE_HEADER_SIZE];
+
+    if(fread(header, 1, sizeof(header), in) != sizeof(header) || !traceIsBinary(header, sizeof(header)))
+    {
+        return NULL;
+    }
+
+    if(header[4] != TRACE_VERSION)
+    {
+        fprintf(stderr, "Error: Unsupported trace version %i.\n", header[4]);
+        return NULL;
+    }
+
+    reader = (TraceReader) calloc(1, sizeof(struct TraceReader_));
+    if(reader == NULL)
+    {
+        return NULL;
+    }
+
+    reader->in = in;
+    reader->count = getLE64(header + 8);
+    return reader;
+}
+
+int traceRead(TraceReader reader, TraceRef *ref)
+{
+    uint64_t value;
+    int tag;
+
+    tag = getc(reader->in);
+    if(tag == EOF)
+    {
+        return 0;
+    }
+    if(tag & 0xc0)
+    {
+        return -1;
+    }
+
+    if(!(tag & REC_SAME_STRIDE))
+    {
+        if(!getVarint(reader->in, &value))
+        {
+            return -1;
+        }
+        reader->last_delta = unzigzag(value);
+    }
+    reader->last_address += (uint64_t)reader->last_delta;
+
+    ref->has_pc = (tag & REC_HAS_PC) != 0;
+    if(ref->has_pc)
+    {
+        if(!getVarint(reader->in, &value))
+        {
+            return -1;
+        }
+        reader->last_pc += (uint64_t)unzigzag(value);
+    }
+
+    ref->address = reader->last_address;
+    ref->pc = ref->has_pc ? reader->last_pc : 0;
+    ref->time = 0;
+    ref->has_time = 0;
+    ref->type = (unsigned char)(tag & REC_TYPE_MASK);
+    ref->size = (unsigned char)(1 << ((tag & REC_SIZE_MASK) >> REC_SIZE_SHIFT));
+    return 1;
+}
+
+uint64_t traceReaderCount(TraceReader reader)
+{
+    return reader->count;
+}
+
+void traceReaderClose(TraceReader reader)
+{
+    free(reader);
+}
+
+/* fillInput
+ *
+ * Moves the unparsed tail of the buffer to the front and reads more
+ * after it. Only whole lines are parsed until the stream ends, unless a
+ * single line fills the entire buffer.
+ */
+
+static void fillInput(TraceInput input)
+{
+    size_t keep, got, i;
+
+    keep = input->length - input->start;
+    memmove(input->buffer, input->buffer + input->start, keep);
+    input->start = 0;
+
+    got = fread(input->buffer + keep, 1, INPUT_BUFFER - keep, input->in);
+    input->length = keep + got;
+    input->eof = (got == 0);
+
+    i = input->length;
+    if(!input->eof)
+    {
+        while(i > 0 && input->buffer[i - 1] != '\n')
+        {
+            i--;
+        }
+        if(i == 0 && input->length == INPUT_BUFFER)
+        {
+            i = input->length;
+        }
+    }
+    input->complete = i;
+}
+
+TraceInput traceInputOpen(FILE *in, int dialect)
+{
+    TraceInput input;
+    int c;
+
+    input = (TraceInput) calloc(1, sizeof(struct TraceInput_));
+    if(input == NULL)
+    {
+        return NULL;
+    }
+    input->in = in;
+
+    c = getc(in);
+    if(c != EOF)
+    {
+        ungetc(c, in);
+    }
+
+    if(c == TRACE_MAGIC[0] || dialect == TRACE_BINARY)
+    {
+        input->dialect = TRACE_BINARY;
+        input->reader = traceReaderOpen(in);
+        if(input->reader == NULL)
+        {
+            free(input);
+            return NULL;
+        }
+        return input;
+    }
+
+    input->buffer = (char *) malloc(INPUT_BUFFER);
+    if(input->buffer == NULL)
+    {
+        free(input);
+        return NULL;
+    }
+
+    /* Guess from the first buffer full */
+    while(!input->eof && input->complete == 0)
+    {
+        fillInput(input);
+    }
+    if(dialect == TRACE_DIALECT_UNKNOWN)
+    {
+        dialect = traceGuessDialect(input->buffer, input->buffer + input->length);
+    }
+    if(dialect == TRACE_DIALECT_UNKNOWN && input->length > 0)
+    {
+        free(input->buffer);
+        free(input);
+        return NULL;
+    }
+
+    input->dialect = dialect;
+    return input;
+}
+
+int traceInputDialect(TraceInput input)
+{
+    return input->dialect;
+}
+
+long traceInputRead(TraceInput input, TraceRef *refs, long max)
+{
+    const char *pos, *complete;
+    long count;
+    int result;
+
+    if(input->failed)
+    {
+        return -1;
+    }
+
+    count = 0;
+    if(input->reader != NULL)
+    {
+        while(count < max && (result = traceRead(input->reader, &refs[count])) > 0)
+        {
+            count++;
+        }
+        if(count < max && result < 0)
+        {
+            /* Hand out what decoded cleanly first */
+            input->failed = 1;
+            return (count > 0) ? count : -1;
+        }
+        return count;
+    }
+
+    while(count < max)
+    {
+        if(input->start >= input->complete)
+        {
+            if(input->eof)
+            {
+                break;
+            }
+            fillInput(input);
+            continue;
+        }
+
+        pos = input->buffer + input->start;
+        complete = input->buffer + input->complete;
+        while(count < max && pos < complete)
+        {
+            count += traceParseLine(input->dialect, &pos, complete, &refs[count]);
+        }
+        input->start = (size_t)(pos - input->buffer);
+    }
+    return count;
+}
+
+void traceInputClose(TraceInput input)
+{
+    if(input->reader != NULL)
+    {
+        traceReaderClose(input->reader);
+    }
+    free(input->buffer);
+    free(input);
+}
+
+int traceIndexWrite(const char *path, uint32_t interval, uint64_t trace_size, const uint64_t *offsets, uint64_t count)
+{
+    unsigned char entry[TRACE_INDEX_HEADER_SIZE];
+    uint64_t i;
+    FILE *out;
+    int ok;
+
+    out = fopen(path, "wb");
+    if(out == NULL)
+    {
+        return 0;
+    }
+
+    memcpy(entry, TRACE_INDEX_MAGIC, 4);
+    entry[4] = (unsigned char)interval;
+    entry[5] = (unsigned char)(interval >> 8);
+    entry[6] = (unsigned char)(interval >> 16);
+    entry[7] = (unsigned char)(interval >> 24);
+    putLE64(entry + 8, trace_size);
+    fwrite(entry, 1, TRACE_INDEX_HEADER_SIZE, out);
+
+    for(i = 0; i < count; i++)
+    {
+        putLE64(entry, offsets[i]);
+        fwrite(entry, 1, 8, out);
+    }
+
+    ok = !ferror(out);
+    return (fclose(out) == 0) && ok;
+}
+
+uint64_t *traceIndexRead(const char *path, uint64_t trace_size, uint32_t *interval, uint64_t *count)
+{
+    unsigned char entry[TRACE_INDEX_HEADER_SIZE];
+    uint64_t *offsets, i;
+    FILE *in;
+    long length;
+
+    in = fopen(path, "rb");
+    if(in == NULL)
+    {
+        return NULL;
+    }
+
+    offsets = NULL;
+    if(fread(entry, 1, TRACE_INDEX_HEADER_SIZE, in) == TRACE_INDEX_HEADER_SIZE
+        && memcmp(entry, TRACE_INDEX_MAGIC, 4) == 0
+        && getLE64(entry + 8) == trace_size
+        && (*interval = (uint32_t)entry[4] | (uint32_t)entry[5] << 8 | (uint32_t)entry[6] << 16 | (uint32_t)entry[7] << 24) != 0
+        && fseek(in, 0, SEEK_END) == 0 && (length = ftell(in)) >= TRACE_INDEX_HEADER_SIZE + 8
+        && fseek(in, TRACE_INDEX_HEADER_SIZE, SEEK_SET) == 0)
+    {
+        *count = (uint64_t)(length - TRACE_INDEX_HEADER_SIZE) / 8;
+        offsets = (uint64_t *) malloc((size_t)*count * sizeof(uint64_t));
+    }
+
+    for(i = 0; offsets != NULL && i < *count; i++)
+    {
+        if(fread(entry, 1, 8, in) != 8)
+        {
+            free(offsets);
+            offsets = NULL;
+            break;
+        }
+        offsets[i] = getLE64(entry);
+    }
+
+    fclose(in);
+    return offsets;
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+/* sendAll
+ *
+ * Writes length bytes to the socket. MSG_NOSIGNAL turns a reader that
+ * went away into an error instead of a SIGPIPE.
+ *
+ * @return  success         1
+ * @return  reader closed   0
+ */
+
+static int sendAll(int fd, const unsigned char *data, size_t length)
+{
+    ssize_t sent;
+
+    while(length > 0)
+    {
+        sent = send(fd, data, length, MSG_NOSIGNAL);
+        if(sent < 0)
+        {
+            return 0;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return 1;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+/* inflateGzip
+ *
+ * Decompresses a gzip stream, including several concatenated members,
+ * into the socket.
+ *
+ * @return  success         1
+ * @return  corrupt input   0
+ */
+
+static int inflateGzip(TraceStream *stream, unsigned char *in, unsigned char *out)
+{
+    z_stream z;
+    size_t length;
+    int result;
+
+    memset(&z, 0, sizeof(z));
+    /* 15 window bits, +32 to accept a gzip or zlib header */
+    if(inflateInit2(&z, 15 + 32) != Z_OK)
+    {
+        return 0;
+    }
+
+    result = Z_OK;
+    while((length = fread(in, 1, STREAM_CHUNK, stream->in)) > 0)
+    {
+        z.next_in = in;
+        z.avail_in = (uInt)length;
+        do
+        {
+            if(result == Z_STREAM_END && z.avail_in > 0)
+            {
+                inflateReset(&z);
+            }
+            z.next_out = out;
+            z.avail_out = STREAM_CHUNK;
+            result = inflate(&z, Z_NO_FLUSH);
+            if(result == Z_BUF_ERROR)
+            {
+                result = Z_OK;
+            }
+            if(result != Z_OK && result != Z_STREAM_END)
+            {
+                inflateEnd(&z);
+                return 0;
+            }
+            if(!sendAll(stream->fd, out, STREAM_CHUNK - z.avail_out))
+            {
+                inflateEnd(&z);
+                return 1;
+            }
+        } while(z.avail_out == 0 || (result == Z_STREAM_END && z.avail_in > 0));
+    }
+
+    inflateEnd(&z);
+    return result == Z_STREAM_END;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/* inflateZstd
+ *
+ * Decompresses a zstd stream, including several concatenated frames,
+ * into the socket.
+ *
+ * @return  success         1
+ * @return  corrupt input   0
+ */
+
+static int inflateZstd(TraceStream *stream, unsigned char *in, unsigned char *out)
+{
+    ZSTD_DStream *z;
+    ZSTD_inBuffer input;
+    ZSTD_outBuffer output;
+    size_t result;
+
+    z = ZSTD_createDStream();
+    if(z == NULL)
+    {
+        return 0;
+    }
+    ZSTD_initDStream(z);
+
+    result = 1;
+    while((input.size = fread(in, 1, STREAM_CHUNK, stream->in)) > 0)
+    {
+        input.src = in;
+        input.pos = 0;
+        do
+        {
+            output.dst = out;
+            output.size = STREAM_CHUNK;
+            output.pos = 0;
+            result = ZSTD_decompressStream(z, &output, &input);
+            if(ZSTD_isError(result))
+            {
+                ZSTD_freeDStream(z);
+                return 0;
+            }
+            if(!sendAll(stream->fd, out, output.pos))
+            {
+                ZSTD_freeDStream(z);
+                return 1;
+            }
+        } while(input.pos < input.size || output.pos == output.size);
+    }
+
+    ZSTD_freeDStream(z);
+    return result == 0;
+}
+#endif
+
+/* decompressThread
+ *
+ * Body of the decompression thread. Closing the socket at the end is
+ * what the reader sees as end of file.
+ */
+
+static void *decompressThread(void *arg)
+{
+    TraceStream *stream;
+    unsigned char *in, *out;
+    int ok;
+
+    stream = (TraceStream *) arg;
+    in = (unsigned char *) malloc(STREAM_CHUNK);
+    out = (unsigned char *) malloc(STREAM_CHUNK);
+    ok = 0;
+
+    if(in != NULL && out != NULL)
+    {
+#ifdef HAVE_ZLIB
+        if(stream->format == FORMAT_GZIP)
+        {
+            ok = inflateGzip(stream, in, out);
+        }
+#endif
+#ifdef HAVE_ZSTD
+        if(stream->format == FORMAT_ZSTD)
+        {
+            ok = inflateZstd(stream, in, out);
+        }
+#endif
+    }
+
+    if(!ok)
+    {
+        fprintf(stderr, "Error: Compressed trace is corrupt or truncated.\n");
+    }
+
+    free(in);
+    free(out);
+    close(stream->fd);
+    fclose(stream->in);
+    return NULL;
+}
+
+FILE *traceDecompress(FILE *in)
+{
+    TraceStream *stream;
+    int c, format, fds[2];
+
+    c = getc(in);
+    if(c == EOF)
+    {
+        return in;
+    }
+    ungetc(c, in);
+
+    if(c == GZIP_MAGIC)
+    {
+        format = FORMAT_GZIP;
+    }
+    else if(c == ZSTD_MAGIC)
+    {
+        format = FORMAT_ZSTD;
+    }
+    else
+    {
+        return in;
+    }
+
+#ifndef HAVE_ZLIB
+    if(format == FORMAT_GZIP)
+    {
+        fprintf(stderr, "Error: Trace is gzip compressed, but gzip support was not built in.\n");
+        fclose(in);
+        return NULL;
+    }
+#endif
+#ifndef HAVE_ZSTD
+    if(format == FORMAT_ZSTD)
+    {
+        fprintf(stderr, "Error: Trace is zstd compressed, but zstd support was not built in.\n");
+        fclose(in);
+        return NULL;
+    }
+#endif
+
+    stream = (TraceStream *) calloc(1, sizeof(TraceStream));
+    if(stream == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+        free(stream);
+        fclose(in);
+        return NULL;
+    }
+
+    stream->in = in;
+    stream->fd = fds[1];
+    stream->format = format;
+    stream->out = fdopen(fds[0], "rb");
+    if(stream->out == NULL || pthread_create(&stream->thread, NULL, decompressThread, stream) != 0)
+    {
+        if(stream->out != NULL)
+        {
+            fclose(stream->out);
+        }
+        else
+        {
+            close(fds[0]);
+        }
+        close(fds[1]);
+        fclose(in);
+        free(stream);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&streamsLock);
+    stream->next = streams;
+    streams = stream;
+    pthread_mutex_unlock(&streamsLock);
+    return stream->out;
+}
+
+int traceClose(FILE *file)
+{
+    TraceStream **link, *stream;
+    int result;
+
+    pthread_mutex_lock(&streamsLock);
+    stream = NULL;
+    for(link = &streams; *link != NULL; link = &(*link)->next)
+    {
+        if((*link)->out == file)
+        {
+            stream = *link;
+            *link = stream->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&streamsLock);
+
+    /* Closing our end first makes a thread blocked in send give up */
+    result = fclose(file);
+    if(stream != NULL)
+    {
+        pthread_join(stream->thread, NULL);
+        free(stream);
+    }
+    return result;
+}
@@ -0,0 +1,367 @@
+/* File: trace.h
+ *
+ * Trace input shared by the cache simulators: a reader for every text
+ * dialect in this directory, and a compact binary trace format.
+ *
+ * The text dialects are:
+ *
+ *      drew        "R:4:1c"                    access:size:hex address
+ *                  (drew_smith_a5.c, cache.c, fail.c)
+ *      swift       "0x37c852: W 0xbfd4b18c"    PC: access address
+ *                  (samples/sim.c, # starts a comment)
+ *      cachesim    "1 1c [120]"                0 ifetch, 1 load, 2 store,
+ *                  (samples/cachesim.c)        optional decimal cycle to
+ *                                              issue the reference at
+ *      din         "0 1c"                      Dinero III/IV: 0 read,
+ *                                              1 write, 2 ifetch, 3 and
+ *                                              4 are ignored
+ *
+ * cachesim and din lines look alike, so din is only picked when asked
+ * for by name, or for files ending in .din.
+ *
+ * The cachesim cycle is returned in TraceRef.time for simulators with a
+ * timing model; the others ignore it. The binary format does not store
+ * it, so tracecvt warns when converting a trace that has cycles.
+ *
+ * A trace file starts with a 16 byte header:
+ *
+ *      bytes 0-3       magic "CTRC"
+ *      byte  4         format version (TRACE_VERSION)
+ *      byte  5         flags (TRACE_HAS_PC if any record carries a PC)
+ *      bytes 6-7       reserved, 0
+ *      bytes 8-15      number of records, little endian, 0 if unknown
+ *
+ * followed by one variable length record per reference:
+ *
+ *      1 byte          bits 0-1  access type (TRACE_READ, TRACE_WRITE,
+ *                                TRACE_IFETCH)
+ *                      bits 2-3  log2 of the access size (1-8 bytes)
+ *                      bit  4    a PC follows
+ *                      bit  5    the address moved by the same amount as
+ *                                in the previous record, so no address
+ *                                delta follows
+ *                      bits 6-7  reserved, 0
+ *      varint          zigzag encoded address - previous address
+ *      varint          zigzag encoded PC - previous PC (if bit 4 is set)
+ *
+ * Varints are little endian base 128: 7 bits per byte, high bit set on
+ * every byte but the last. Addresses and PCs are 64 bits and deltas wrap
+ * around modulo 2^64. Consecutive references are usually close
+ * together, so most records take 2-4 bytes against 10-25 for text.
+ */
+
+#ifndef CDA_TRACE_H_
+#define CDA_TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Format Constants */
+#define TRACE_MAGIC "CTRC"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 16
+
+/* Header Flags */
+#define TRACE_HAS_PC 0x01
+
+/* Access Types */
+#define TRACE_READ 0
+#define TRACE_WRITE 1
+#define TRACE_IFETCH 2
+#define TRACE_INVALID 3     /* a text line that did not parse, never stored */
+
+/* Dialects */
+#define TRACE_DIALECT_UNKNOWN 0
+#define TRACE_DREW 1
+#define TRACE_SWIFT 2
+#define TRACE_CACHESIM 3
+#define TRACE_DIN 4
+#define TRACE_BINARY 5
+#define TRACE_DIALECTS 6
+
+/* Dialect names, indexed by dialect: "unknown", "drew", "swift", ... */
+extern const char *traceDialectNames[TRACE_DIALECTS];
+
+/* A single memory reference. */
+typedef struct TraceRef_ {
+    uint64_t address;
+    uint64_t pc;
+    unsigned char type;     /* TRACE_READ, TRACE_WRITE or TRACE_IFETCH */
+    unsigned char size;     /* access size in bytes: 1, 2, 4 or 8 (text
+                               traces may hold others) */
+    unsigned char has_pc;   /* 1 if pc is meaningful */
+    uint64_t time;          /* cycle to issue at (cachesim text only) */
+    unsigned char has_time; /* 1 if time is meaningful */
+} TraceRef;
+
+typedef struct TraceWriter_* TraceWriter;
+typedef struct TraceReader_* TraceReader;
+typedef struct TraceInput_* TraceInput;
+
+/* traceDialectByName
+ *
+ * Looks up a dialect by its name, or guesses din from a .din file name.
+ *
+ * @param   name            dialect name or trace file name
+ *
+ * @return  known           TRACE_DREW ... TRACE_BINARY
+ * @return  unknown         TRACE_DIALECT_UNKNOWN
+ */
+
+int traceDialectByName(const char *name);
+
+/* traceGuessDialect
+ *
+ * Guesses the text dialect from the first line that is not blank or a
+ * # comment in [data, end).
+ *
+ * @return  recognized      TRACE_DREW, TRACE_SWIFT or TRACE_CACHESIM
+ * @return  anything else   TRACE_DIALECT_UNKNOWN
+ */
+
+int traceGuessDialect(const char *data, const char *end);
+
+/* traceParseLine
+ *
+ * Parses the text line starting at *pos in the given dialect and moves
+ * *pos past its newline. Lines that do not parse are returned with type
+ * TRACE_INVALID so the caller can decide whether to skip them or stop.
+ * Accesses without a size in the dialect get size 4.
+ *
+ * @param   dialect         one of the text dialects
+ * @param   pos             start of the line, moved to the next line
+ * @param   end             end of the buffer
+ * @param   ref             filled in with the reference
+ *
+ * @return  reference       1
+ * @return  blank/comment   0
+ */
+
+int traceParseLine(int dialect, const char **pos, const char *end, TraceRef *ref);
+
+/* traceInputOpen
+ *
+ * Starts reading a trace in any dialect. A binary trace is recognized by
+ * its magic; for text, dialect may name one, or be TRACE_DIALECT_UNKNOWN
+ * to guess from the first line.
+ *
+ * @param   in              stream positioned at the start of the trace
+ * @param   dialect         text dialect, or TRACE_DIALECT_UNKNOWN
+ *
+ * @return  success         new TraceInput
+ * @return  failure         NULL (unrecognized or bad binary header)
+ */
+
+TraceInput traceInputOpen(FILE *in, int dialect);
+
+/* traceInputDialect
+ *
+ * Returns the dialect being read, TRACE_BINARY for binary traces.
+ */
+
+int traceInputDialect(TraceInput input);
+
+/* traceInputRead
+ *
+ * Reads the next batch of references. Text lines that do not parse come
+ * back with type TRACE_INVALID.
+ *
+ * @param   input           source
+ * @param   refs            array of at least max references
+ * @param   max             batch size
+ *
+ * @return  success         number of references, 1 to max
+ * @return  end of trace    0
+ * @return  corrupt binary  -1
+ */
+
+long traceInputRead(TraceInput input, TraceRef *refs, long max);
+
+/* traceInputClose
+ *
+ * Frees the input. Does not close the stream.
+ */
+
+void traceInputClose(TraceInput input);
+
+/* traceIsBinary
+ *
+ * Checks whether a buffer starts with the binary trace magic.
+ *
+ * @param   data            first bytes of a file
+ * @param   length          number of bytes available
+ *
+ * @return  binary          1
+ * @return  anything else   0
+ */
+
+int traceIsBinary(const unsigned char *data, size_t length);
+
+/* traceWriterOpen
+ *
+ * Writes a trace header to out and returns a writer for records. If out
+ * is seekable, the record count in the header is filled in on close.
+ *
+ * @param   out             stream opened for binary writing
+ * @param   flags           header flags, e.g. TRACE_HAS_PC
+ *
+ * @return  success         new TraceWriter
+ * @return  failure         NULL
+ */
+
+TraceWriter traceWriterOpen(FILE *out, int flags);
+
+/* traceWrite
+ *
+ * Appends one reference to the trace.
+ *
+ * @param   writer          target writer
+ * @param   ref             reference to encode
+ *
+ * @return  success         1
+ * @return  failure         0
+ */
+
+int traceWrite(TraceWriter writer, const TraceRef *ref);
+
+/* traceWriterClose
+ *
+ * Flushes the writer, patches the record count into the header when the
+ * stream allows it and frees the writer. Does not close the stream.
+ *
+ * @param   writer          writer to close
+ *
+ * @return  number of records written
+ */
+
+uint64_t traceWriterClose(TraceWriter writer);
+
+/* traceReaderOpen
+ *
+ * Reads and checks a trace header from in. The stream must be positioned
+ * at the start of the header.
+ *
+ * @param   in              stream opened for binary reading
+ *
+ * @return  success         new TraceReader
+ * @return  failure         NULL (bad magic or unsupported version)
+ */
+
+TraceReader traceReaderOpen(FILE *in);
+
+/* traceRead
+ *
+ * Decodes the next reference.
+ *
+ * @param   reader          source reader
+ * @param   ref             filled in with the reference
+ *
+ * @return  success         1
+ * @return  end of trace    0
+ * @return  corrupt record  -1
+ */
+
+int traceRead(TraceReader reader, TraceRef *ref);
+
+/* traceReaderCount
+ *
+ * Returns the record count stored in the header, or 0 if the writer did
+ * not know it.
+ */
+
+uint64_t traceReaderCount(TraceReader reader);
+
+/* traceReaderClose
+ *
+ * Frees the reader. Does not close the stream.
+ */
+
+void traceReaderClose(TraceReader reader);
+
+/* Sidecar Index
+ *
+ * A text trace can have a sidecar index (by convention <trace>.idx)
+ * holding the byte offset of every interval-th reference, so a run can
+ * start at any reference without rescanning the file before it:
+ *
+ *      bytes 0-3       magic "CIDX"
+ *      bytes 4-7       interval, little endian
+ *      bytes 8-15      size of the indexed trace in bytes, little endian
+ *      bytes 16-       offset of reference 0, interval, 2 * interval, ...
+ *                      each 8 bytes, little endian
+ */
+
+#define TRACE_INDEX_MAGIC "CIDX"
+#define TRACE_INDEX_HEADER_SIZE 16
+
+/* traceIndexWrite
+ *
+ * Writes a sidecar index.
+ *
+ * @param   path            index file name
+ * @param   interval        references between entries
+ * @param   trace_size      size of the indexed trace in bytes
+ * @param   offsets         byte offset of every interval-th reference
+ * @param   count           number of offsets
+ *
+ * @return  success         1
+ * @return  failure         0
+ */
+
+int traceIndexWrite(const char *path, uint32_t interval, uint64_t trace_size, const uint64_t *offsets, uint64_t count);
+
+/* traceIndexRead
+ *
+ * Reads a sidecar index, rejecting it if it was built for a trace of a
+ * different size. A successful read always has a nonzero interval and
+ * at least one offset.
+ *
+ * @param   path            index file name
+ * @param   trace_size      size of the trace about to be read
+ * @param   interval        set to the references between entries
+ * @param   count           set to the number of offsets
+ *
+ * @return  success         offsets, to be freed by the caller
+ * @return  failure         NULL (missing, corrupt or stale index)
+ */
+
+uint64_t *traceIndexRead(const char *path, uint64_t trace_size, uint32_t *interval, uint64_t *count);
+
+/* traceDecompress
+ *
+ * Checks whether in holds a gzip or zstd compressed trace. If it does, a
+ * thread is started that decompresses in and feeds the result through a
+ * socket pair, and the reading end is returned as a stream. Otherwise in
+ * itself is returned. Either way the returned stream owns in and must be
+ * closed with traceClose.
+ *
+ * gzip needs the library built with HAVE_ZLIB (-lz) and zstd with
+ * HAVE_ZSTD (-lzstd).
+ *
+ * @param   in              stream opened for binary reading
+ *
+ * @return  success         stream of uncompressed trace data
+ * @return  failure         NULL (in is closed)
+ */
+
+FILE *traceDecompress(FILE *in);
+
+/* traceClose
+ *
+ * Closes a stream returned by traceDecompress and waits for its
+ * decompression thread, if any, to finish.
+ *
+ * @return  result of fclose
+ */
+
+int traceClose(FILE *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,185 @@
+/* File: tracecvt.c
+ *
+ * Converts the text trace dialects used by the simulators in this
+ * directory into the binary format described in trace.h, and dumps
+ * binary traces back out as text.
+ *
+ * Usage: ./tracecvt [-h] [-f <dialect>] <text trace> <binary trace>
+ *        ./tracecvt -d <binary trace>
+ *
+ * <dialect> is drew, swift, cachesim or din (see trace.h). If -f is not
+ * given the dialect is guessed from the first line that is not blank or
+ * a # comment, except that .din files are read as din. The binary
+ * format has no room for the issue cycles cachesim traces may carry, so
+ * they are dropped with a warning.
+ *
+ * Compile: gcc -O2 -o tracecvt tracecvt.c trace.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+#define BATCH 4096
+
+static int convert(FILE *in, FILE *out, int dialect)
+{
+    TraceRef refs[BATCH];
+    TraceWriter writer;
+    TraceInput input;
+    long count, i, lineNo, timed;
+
+    input = traceInputOpen(in, dialect);
+    if(input == NULL)
+    {
+        fprintf(stderr, "Error: Could not recognize the trace dialect.\n");
+        return 0;
+    }
+    dialect = traceInputDialect(input);
+    if(dialect == TRACE_BINARY)
+    {
+        fprintf(stderr, "Error: Trace is already binary.\n");
+        traceInputClose(input);
+        return 0;
+    }
+
+    writer = traceWriterOpen(out, (dialect == TRACE_SWIFT) ? TRACE_HAS_PC : 0);
+    if(writer == NULL)
+    {
+        fprintf(stderr, "Error: Could not write trace header.\n");
+        traceInputClose(input);
+        return 0;
+    }
+
+    lineNo = 0;
+    timed = 0;
+    while((count = traceInputRead(input, refs, BATCH)) > 0)
+    {
+        for(i = 0; i < count; i++)
+        {
+            lineNo++;
+            timed += refs[i].has_time;
+            if(refs[i].type == TRACE_INVALID || refs[i].size > 8 || (refs[i].size & (refs[i].size - 1)) != 0)
+            {
+                fprintf(stderr, "Error: Skipping bad %s reference %li.\n", traceDialectNames[dialect], lineNo);
+            }
+            else if(!traceWrite(writer, &refs[i]))
+            {
+                fprintf(stderr, "Error: Write failed.\n");
+                traceWriterClose(writer);
+                traceInputClose(input);
+                return 0;
+            }
+        }
+    }
+
+    traceInputClose(input);
+    if(timed > 0)
+    {
+        fprintf(stderr, "Warning: Dropped the issue cycles of %li references; binary traces do not store them.\n", timed);
+    }
+    fprintf(stderr, "Converted %lu %s references.\n", (unsigned long)traceWriterClose(writer), traceDialectNames[dialect]);
+    return 1;
+}
+
+static int dump(FILE *in)
+{
+    TraceReader reader;
+    TraceRef ref;
+    int result;
+
+    reader = traceReaderOpen(in);
+    if(reader == NULL)
+    {
+        fprintf(stderr, "Error: Not a binary trace.\n");
+        return 0;
+    }
+
+    while((result = traceRead(reader, &ref)) > 0)
+    {
+        if(ref.type == TRACE_IFETCH)
+        {
+            printf("0 %lx\n", (unsigned long)ref.address);
+        }
+        else if(ref.has_pc)
+        {
+            printf("0x%lx: %c 0x%lx\n", (unsigned long)ref.pc, ref.type == TRACE_WRITE ? 'W' : 'R', (unsigned long)ref.address);
+        }
+        else
+        {
+            printf("%c:%i:%lx\n", ref.type == TRACE_WRITE ? 'W' : 'R', ref.size, (unsigned long)ref.address);
+        }
+    }
+
+    traceReaderClose(reader);
+    if(result < 0)
+    {
+        fprintf(stderr, "Error: Corrupt record.\n");
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    int arg, dialect, ok;
+
+    dialect = TRACE_DIALECT_UNKNOWN;
+    arg = 1;
+
+    if(argc == 3 && strcmp(argv[1], "-d") == 0)
+    {
+        in = fopen(argv[2], "rb");
+        if(in == NULL)
+        {
+            fprintf(stderr, "Error: Could not open %s.\n", argv[2]);
+            return 1;
+        }
+        ok = dump(in);
+        fclose(in);
+        return ok ? 0 : 1;
+    }
+
+    if(argc > 2 && strcmp(argv[1], "-f") == 0)
+    {
+        dialect = traceDialectByName(argv[2]);
+        if(dialect == TRACE_DIALECT_UNKNOWN || dialect == TRACE_BINARY)
+        {
+            fprintf(stderr, "Error: Unknown dialect %s.\n", argv[2]);
+            return 1;
+        }
+        arg = 3;
+    }
+
+    if(argc - arg != 2 || strcmp(argv[1], "-h") == 0)
+    {
+        fprintf(stderr, "Usage: ./tracecvt [-h] [-f drew|swift|cachesim|din] <text trace> <binary trace>\n       ./tracecvt -d <binary trace>\n");
+        return 1;
+    }
+
+    if(dialect == TRACE_DIALECT_UNKNOWN)
+    {
+        dialect = traceDialectByName(argv[arg]);
+    }
+
+    in = fopen(argv[arg], "rb");
+    if(in == NULL)
+    {
+        fprintf(stderr, "Error: Could not open %s.\n", argv[arg]);
+        return 1;
+    }
+    out = fopen(argv[arg + 1], "wb");
+    if(out == NULL)
+    {
+        fprintf(stderr, "Error: Could not create %s.\n", argv[arg + 1]);
+        fclose(in);
+        return 1;
+    }
+
+    ok = convert(in, out, dialect);
+    fclose(in);
+    fclose(out);
+    return ok ? 0 : 1;
+}